@@ -11,6 +11,7 @@
 #define MMAP_NONE  0x00000000 // no access
 #define MMAP_READ  0x00000001 // can read
 #define MMAP_WRITE 0x00000002 // can write
+#define MMAP_HUGE  0x00000004 // huge page (2 MiB on x86_64), both @va and @pa aligned
 
 // Memory area for [@start, @end)
 typedef struct {
@@ -31,6 +31,21 @@ AM_DEVREG(21, NET_CONFIG,   RD, bool present);
 AM_DEVREG(22, NET_STATUS,   RD, int rx_len, tx_len);
 AM_DEVREG(23, NET_TX,       WR, Area buf);
 AM_DEVREG(24, NET_RX,       WR, Area buf);
+AM_DEVREG(25, UART_TXBUF,   WR, const char *buf; int len);
+AM_DEVREG(26, TIMER_CTRL,   WR, int hz; uint64_t deadline);
+AM_DEVREG(27, TIMER_CYCLES, RD, uint64_t cycles, hz);
+
+// Timer
+
+// AM_TIMER_CTRL programs the timer interrupt of the calling CPU:
+//   hz > 0:  periodic, hz interrupts per second
+//   hz == 0: one-shot, a single interrupt when TIMER_UPTIME reaches
+//            deadline (us); deadline == 0 stops the timer
+// A one-shot timer may fire early (never late by more than the hardware
+// resolution); the handler should check the time and program it again.
+//
+// AM_TIMER_CYCLES reads the free-running cycle counter and its rate, for
+// timing short code paths.
 
 // Input
 
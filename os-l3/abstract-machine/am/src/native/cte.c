@@ -1,9 +1,13 @@
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <string.h>
+#include <time.h>
 #include "platform.h"
 
 #define TIMER_HZ 100
 #define SYSCALL_INSTR_LEN 7
+#define PEND_TIMER 1
+#define PEND_IODEV 2
 
 static Context* (*user_handler)(Event, Context*) = NULL;
 
@@ -36,25 +40,32 @@ static void irq_handle(Context *c) {
   __am_panic_on_return();
 }
 
+static void unblock_intr(sigset_t *set) {
+  sigdelset(set, SIGVTALRM);
+  sigdelset(set, SIGUSR1);
+}
+
 static void setup_stack(uintptr_t event, ucontext_t *uc) {
   void *rip = (void *)uc->uc_mcontext.gregs[REG_RIP];
   extern uint8_t _start, _etext;
   int trap_from_user = __am_in_userspace(rip);
+  // a replayed interrupt is raised by iset() or delivered by iret() on
+  // purpose, at a point where it is known to be safe
   int signal_safe = IN_RANGE(rip, RANGE(&_start, &_etext)) || trap_from_user ||
-    // Hack here: "+13" points to the instruction after syscall. This is the
-    // instruction which will trigger the pending signal if interrupt is enabled.
-    (rip == (void *)&sigprocmask + 13);
+    thiscpu->replaying;
 
   if (((event == EVENT_IRQ_IODEV) || (event == EVENT_IRQ_TIMER)) && !signal_safe) {
     // Shared libraries contain code which are not reenterable.
     // If the signal comes when executing code in shared libraries,
     // the signal handler can not call any function which is not signal-safe,
     // else the behavior is undefined (may be dead lock).
-    // To handle this, we just refuse to handle the signal and return directly
-    // to pretend missing the interrupt.
+    // To handle this, we defer the interrupt until interrupts are enabled
+    // again or a context is restored.
     // See man 7 signal-safety for more information.
+    thiscpu->intr_pending |= (event == EVENT_IRQ_TIMER) ? PEND_TIMER : PEND_IODEV;
     return;
   }
+  thiscpu->replaying = 0;
 
   if (trap_from_user) __am_pmem_unprotect();
 
@@ -69,11 +80,15 @@ static void setup_stack(uintptr_t event, ucontext_t *uc) {
   if ((rsp + 8) % 16 != 0) rsp -= 8;
   Context *c = (void *)rsp;
 
-  // save the context on the stack
+  // save the context on the stack, with the virtual interrupt flag
+  // kept in its sigmask as a blocked SIGVTALRM
   c->uc = *uc;
+  if (thiscpu->intr) unblock_intr(&c->uc.uc_sigmask);
+  else sigaddset(&c->uc.uc_sigmask, SIGVTALRM);
 
   // disable interrupt
-  __am_get_intr_sigmask(&uc->uc_sigmask);
+  thiscpu->intr = 0;
+  unblock_intr(&uc->uc_sigmask);
 
   // call irq_handle after returning from the signal handler
   uc->uc_mcontext.gregs[REG_RDI] = (uintptr_t)c;
@@ -86,10 +101,27 @@ static void iret(ucontext_t *uc) {
   // restore the context
   *uc = c->uc;
   thiscpu->ksp = c->ksp;
+  thiscpu->intr = __am_is_sigmask_sti(&uc->uc_sigmask);
+  unblock_intr(&uc->uc_sigmask);
   if (__am_in_userspace((void *)uc->uc_mcontext.gregs[REG_RIP])) __am_pmem_protect();
+
+  // a deferred interrupt is taken right at the restored context, without
+  // another signal
+  int pend = thiscpu->intr_pending;
+  if (thiscpu->intr && pend) {
+    int bit = (pend & PEND_TIMER) ? PEND_TIMER : PEND_IODEV;
+    thiscpu->intr_pending = pend & ~bit;
+    thiscpu->ev = (Event) { .event = (bit == PEND_TIMER) ? EVENT_IRQ_TIMER : EVENT_IRQ_IODEV };
+    thiscpu->replaying = 1;
+    setup_stack(thiscpu->ev.event, uc);
+  }
 }
 
 static void sig_handler(int sig, siginfo_t *info, void *ucontext) {
+  if ((sig == SIGVTALRM || sig == SIGUSR1) && !thiscpu->intr) {
+    thiscpu->intr_pending |= (sig == SIGVTALRM) ? PEND_TIMER : PEND_IODEV;
+    return;
+  }
   thiscpu->ev = (Event) {0};
   thiscpu->ev.event = EVENT_ERROR;
   switch (sig) {
@@ -143,23 +175,63 @@ static void install_signal_handler() {
   assert(ret == 0);
 }
 
-// setitimer() are inherited across fork(), should be called again from children
-void __am_init_timer_irq() {
-  iset(0);
+// a timer that signals SIGVTALRM to the calling process
+static timer_t new_timer(clockid_t clk) {
+  struct sigevent sev = {};
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGVTALRM;
+  sev._sigev_un._tid = syscall(SYS_gettid);
+  timer_t t;
+  int ret = timer_create(clk, &sev, &t);
+  assert(ret == 0);
+  return t;
+}
 
+// the periodic tick counts the cpu time of this cpu; hz == 0 stops it
+static void set_periodic(int hz) {
+  int64_t ns = (hz > 0) ? 1000000000L / hz : 0;
   struct itimerval it = {};
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 1000000 / TIMER_HZ;
+  it.it_value.tv_sec = ns / 1000000000L;
+  it.it_value.tv_usec = ns % 1000000000L / 1000;
   it.it_interval = it.it_value;
   int ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
   assert(ret == 0);
 }
 
+// setitimer() are inherited across fork(), should be called again from children
+void __am_init_timer_irq() {
+  iset(0);
+  thiscpu->has_oneshot = 0;  // timer_create() timers are not inherited by fork()
+  set_periodic(TIMER_HZ);
+}
+
+// AM_TIMER_CTRL: a one-shot deadline is a wall-clock delay, so it runs on
+// the monotonic clock instead of the cpu time; delay_us < 0 stops it
+void __am_timer_program(int hz, int64_t delay_us) {
+  if (!thiscpu->has_oneshot) {
+    thiscpu->oneshot = new_timer(CLOCK_MONOTONIC);
+    thiscpu->has_oneshot = 1;
+  }
+  struct itimerspec its = {};
+  if (hz == 0 && delay_us >= 0) {
+    if (delay_us == 0) delay_us = 1;  // all zero would disarm the timer
+    its.it_value.tv_sec = delay_us / 1000000;
+    its.it_value.tv_nsec = delay_us % 1000000 * 1000;
+  }
+  int ret = timer_settime(thiscpu->oneshot, 0, &its, NULL);
+  assert(ret == 0);
+  set_periodic(hz);
+}
+
 bool cte_init(Context*(*handler)(Event, Context*)) {
   user_handler = handler;
 
   install_signal_handler();
   __am_init_timer_irq();
+  // from now on only the virtual flag masks interrupts
+  extern sigset_t __am_intr_sigmask;
+  int ret = sigprocmask(SIG_UNBLOCK, &__am_intr_sigmask, NULL);
+  assert(ret == 0);
   return true;
 }
 
@@ -184,16 +256,19 @@ void yield() {
   raise(SIGUSR2);
 }
 
+// interrupts are masked by a flag in per-cpu memory instead of the
+// signal mask, so neither of these makes a system call
 bool ienabled() {
-  sigset_t set;
-  int ret = sigprocmask(0, NULL, &set);
-  assert(ret == 0);
-  return __am_is_sigmask_sti(&set);
+  return thiscpu->intr;
 }
 
 void iset(bool enable) {
-  extern sigset_t __am_intr_sigmask;
-  // NOTE: sigprocmask does not supported in multithreading
-  int ret = sigprocmask(enable ? SIG_UNBLOCK : SIG_BLOCK, &__am_intr_sigmask, NULL);
-  assert(ret == 0);
+  thiscpu->intr = enable;
+  if (enable && thiscpu->intr_pending) {
+    // replay what was deferred while disabled; delivered before raise() returns
+    int pend = __atomic_exchange_n(&thiscpu->intr_pending, 0, __ATOMIC_SEQ_CST);
+    if (pend & PEND_TIMER) { thiscpu->replaying = 1; raise(SIGVTALRM); }
+    if (pend & PEND_IODEV) { thiscpu->replaying = 1; raise(SIGUSR1); }
+    thiscpu->replaying = 0;
+  }
 }
@@ -1,8 +1,16 @@
 #include <am.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 static struct timeval boot_time = {};
+static uint64_t tsc_hz;
+
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile ("rdtsc": "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
 
 void __am_timer_config(AM_TIMER_CONFIG_T *cfg) {
   cfg->present = cfg->has_rtc = true;
@@ -27,6 +35,35 @@ void __am_timer_uptime(AM_TIMER_UPTIME_T *uptime) {
   uptime->us = seconds * 1000000 + (useconds + 500);
 }
 
+void __am_timer_cycles(AM_TIMER_CYCLES_T *cyc) {
+  cyc->cycles = rdtsc();
+  cyc->hz = tsc_hz;
+}
+
+void __am_timer_program(int hz, int64_t delay_us);
+
+void __am_timer_ctrl(AM_TIMER_CTRL_T *ctl) {
+  AM_TIMER_UPTIME_T now;
+  __am_timer_uptime(&now);
+  int64_t delay = -1;
+  if (ctl->hz == 0 && ctl->deadline != 0)
+    delay = ctl->deadline > now.us ? ctl->deadline - now.us : 0;
+  __am_timer_program(ctl->hz, delay);
+}
+
+// the host TSC rate, measured against the monotonic clock over 10 ms
+static void tsc_calibrate() {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t c0 = rdtsc();
+  usleep(10000);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  uint64_t c1 = rdtsc();
+  uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+  tsc_hz = (c1 - c0) * 1000000000ULL / ns;
+}
+
 void __am_timer_init() {
   gettimeofday(&boot_time, NULL);
+  tsc_calibrate();
 }
@@ -150,7 +150,9 @@ static void init_platform() {
   uc_example.uc_mcontext.fpregs = NULL; // clear the FPU context
   __am_get_intr_sigmask(&uc_example.uc_sigmask);
 
-  // disable interrupts by default
+  // disable interrupts by default; the signals stay blocked until cte_init()
+  ret2 = sigprocmask(SIG_BLOCK, &__am_intr_sigmask, NULL);
+  assert(ret2 == 0);
   iset(0);
 
   // set ncpu
@@ -4,6 +4,7 @@
 #include <am.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <klib.h>
 #include <klib-macros.h>
 
@@ -11,6 +12,7 @@ void __am_get_example_uc(Context *r);
 void __am_get_intr_sigmask(sigset_t *s);
 int __am_is_sigmask_sti(sigset_t *s);
 void __am_init_timer_irq();
+void __am_timer_program(int hz, int64_t delay_us);
 void __am_pmem_map(void *va, void *pa, int prot);
 void __am_pmem_unmap(void *va);
 
@@ -20,6 +22,13 @@ typedef struct {
   uintptr_t ksp;
   int cpuid;
   Event ev; // similar to cause register in mips/riscv
+  // virtual interrupt flag: the interrupt signals are never blocked after
+  // cte_init(); one arriving while intr == 0 is recorded in intr_pending
+  // and replayed when interrupts are enabled again
+  volatile int intr, intr_pending, replaying;
+  // one-shot timer on the monotonic clock, created on first use
+  timer_t oneshot;
+  int has_oneshot;
   uint8_t sigstack[SIGSTKSZ];
 } __am_cpu_t;
 extern __am_cpu_t *__am_cpu_struct;
@@ -83,6 +83,7 @@ end:
 }
 
 void map(AddrSpace *as, void *va, void *pa, int prot) {
+  panic_on(prot & MMAP_HUGE, "huge pages are not supported");
   assert(IN_RANGE(va, USER_SPACE));
   assert((uintptr_t)va % __am_pgsize == 0);
   assert((uintptr_t)pa % __am_pgsize == 0);
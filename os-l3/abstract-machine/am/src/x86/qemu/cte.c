@@ -40,7 +40,7 @@ void __am_irq_handle(struct trap_frame *tf) {
   // no ss/esp saved for DPL_KERNEL
   saved_ctx->esp = (tf->cs & DPL_USER ? tf->esp : (uint32_t)(tf + 1) - 8);
 #endif
-  saved_ctx->cr3    = (void *)get_cr3();
+  saved_ctx->cr3    = (void *)(get_cr3() & ~0xfffL); // drop the PCID
 
   #define IRQ    T_IRQ0 +
   #define MSG(m) ev.msg = m;
@@ -56,6 +56,9 @@ void __am_irq_handle(struct trap_frame *tf) {
       ev.event = EVENT_IRQ_IODEV; break;
     case IRQ 4: MSG("I/O device IRQ4 (COM1)")
       ev.event = EVENT_IRQ_IODEV; break;
+    case IRQ IRQ_TLB: // handled inside AM, invisible to the OS
+      __am_tlb_shootdown();
+      __am_iret(saved_ctx);
     case EX_SYSCALL: MSG("int $0x80 system call")
       ev.event = EVENT_SYSCALL; break;
     case EX_YIELD: MSG("int $0x81 yield")
@@ -92,8 +95,9 @@ void __am_irq_handle(struct trap_frame *tf) {
   Context *ret_ctx = user_handler(ev, saved_ctx);
   panic_on(!ret_ctx, "returning to NULL context");
 
+  __am_tlb_flush();
   if (ret_ctx->cr3) {
-    set_cr3(ret_ctx->cr3);
+    __am_switch_as(ret_ctx->cr3);
 #if __x86_64__
     CPU->tss.rsp0 = ret_ctx->rsp0;
 #else
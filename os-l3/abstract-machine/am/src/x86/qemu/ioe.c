@@ -27,6 +27,15 @@ static void uart_tx(AM_UART_TX_T *send) {
   outb(COM1, send->data);
 }
 
+// the whole buffer in one string instruction; qemu's UART never stalls
+static void uart_txbuf(AM_UART_TXBUF_T *send) {
+  const char *buf = send->buf;
+  int len = send->len;
+  if (len > 0) {
+    asm volatile ("rep outsb" : "+S"(buf), "+c"(len) : "d"(COM1) : "memory");
+  }
+}
+
 static void uart_rx(AM_UART_RX_T *recv) {
   recv->data = (inb(COM1 + 5) & 0x1) ? inb(COM1) : -1;
 }
@@ -35,9 +44,12 @@ static void uart_rx(AM_UART_RX_T *recv) {
 // ====================================================
 
 static AM_TIMER_RTC_T boot_date;
-static uint32_t freq_mhz = 2000;
+static uint64_t tsc_hz = 2000000000;
 static uint64_t uptsc;
+static uint32_t tsc_mult = (1000000ULL << 32) / 2000000000;  // us = tsc * tsc_mult / 2^32
+static uint64_t lapic_hz;  // LAPIC timer ticks per second, calibrated in timer_init()
 static void timer_rtc(AM_TIMER_RTC_T *rtc);
+static void lapic_calibrate();
 
 static inline int read_rtc(int reg) {
   outb(0x70, reg);
@@ -56,31 +68,28 @@ static void read_rtc_async(AM_TIMER_RTC_T *rtc) {
   };
 }
 
-static void wait_sec(AM_TIMER_RTC_T *t1) {
-  AM_TIMER_RTC_T t0;
-  while (1) {
-    read_rtc_async(&t0);
-    for (int volatile i = 0; i < 100000; i++) ;
-    read_rtc_async(t1);
-    if (t0.second != t1->second) {
-      return;
-    }
-  }
-}
-
-static uint32_t estimate_freq() {
-  AM_TIMER_RTC_T rtc1, rtc2;
-  uint64_t tsc1, tsc2, t1, t2;
-  wait_sec(&rtc1); tsc1 = rdtsc(); t1 = rtc1.minute * 60 + rtc1.second;
-  wait_sec(&rtc2); tsc2 = rdtsc(); t2 = rtc2.minute * 60 + rtc2.second;
-  if (t1 >= t2) return estimate_freq(); // passed an hour; try again
-  return ((tsc2 - tsc1) >> 20) / (t2 - t1);
+// Count PIT channel 2 (1193182 Hz, gated by port 0x61) down in mode 0
+// for 50 ms and read the TSC on both ends; the RTC second boundaries
+// used before took up to two seconds to find.
+#define PIT_HZ    1193182
+#define PIT_MS    50
+static uint64_t estimate_freq() {
+  uint32_t cnt = PIT_HZ / 1000 * PIT_MS;
+  outb(0x61, (inb(0x61) & ~0x02) | 0x01);  // gate on, speaker off
+  outb(0x43, 0xb0);                        // channel 2, lo/hi byte, mode 0
+  outb(0x42, cnt & 0xff);
+  outb(0x42, cnt >> 8);
+  uint64_t t0 = rdtsc();
+  while (!(inb(0x61) & 0x20)) ;            // OUT2 goes high at zero
+  return (rdtsc() - t0) * PIT_HZ / cnt;
 }
 
 static void timer_init() {
-  freq_mhz = estimate_freq();
+  tsc_hz = estimate_freq();
+  tsc_mult = (1000000ULL << 32) / tsc_hz;
   timer_rtc(&boot_date);
   uptsc = rdtsc();
+  lapic_calibrate();
 }
 
 static void timer_config(AM_TIMER_CONFIG_T *cfg) {
@@ -95,10 +104,25 @@ static void timer_rtc(AM_TIMER_RTC_T *rtc) {
   } while (tmp != rtc->second);
 }
 
+// The TSC of qemu runs at a constant rate and is synchronized across
+// CPUs, so the uptime is a multiply and a shift instead of a division.
+// The product is split in two halves so that it never overflows.
+uint64_t __am_timer_us() {
+  uint64_t d = rdtsc() - uptsc;
+  return (d >> 32) * tsc_mult + (((d & 0xffffffff) * tsc_mult) >> 32);
+}
+
 static void timer_uptime(AM_TIMER_UPTIME_T *upt) {
-  upt->us = (rdtsc() - uptsc) / freq_mhz;
+  upt->us = __am_timer_us();
+}
+
+static void timer_cycles(AM_TIMER_CYCLES_T *cyc) {
+  cyc->cycles = rdtsc();
+  cyc->hz = tsc_hz;
 }
 
+static void timer_ctrl(AM_TIMER_CTRL_T *ctl);
+
 // Input
 // ====================================================
 
@@ -187,19 +211,64 @@ static void gpu_config(AM_GPU_CONFIG_T *cfg) {
   };
 }
 
+// Pixel kernels. The kernel is built with -mno-sse (vector registers are
+// not saved across traps), so these work a machine word at a time instead.
+typedef uint32_t u32_unaligned __attribute__((aligned(1), may_alias));
+typedef uint64_t u64_unaligned __attribute__((aligned(1), may_alias));
+
+// 0x00RRGGBB -> packed b, g, r; four pixels are three 32-bit stores
+static void px_convert(struct pixel *dst, const uint32_t *src, int n) {
+  u32_unaligned *d = (u32_unaligned *)dst;
+  for (; n >= 4; n -= 4, src += 4, d += 3) {
+    uint32_t p0 = src[0], p1 = src[1], p2 = src[2], p3 = src[3];
+    d[0] = (p0 & 0xffffff)        | (p1 << 24);
+    d[1] = ((p1 >> 8) & 0xffff)   | (p2 << 16);
+    d[2] = ((p2 >> 16) & 0xff)    | (p3 << 8);
+  }
+  struct pixel *px = (struct pixel *)d;
+  for (; n > 0; n--, src++, px++) {
+    uint32_t p = *src;
+    *px = (struct pixel) { .r = R(p), .g = G(p), .b = B(p) };
+  }
+}
+
+static void px_copy(void *dst, const void *src, size_t n) {
+  u64_unaligned *d = dst;
+  const u64_unaligned *s = src;
+  for (; n >= 32; n -= 32, d += 4, s += 4) {
+    uint64_t a = s[0], b = s[1], c = s[2], e = s[3];
+    d[0] = a; d[1] = b; d[2] = c; d[3] = e;
+  }
+  for (; n >= 8; n -= 8) *d++ = *s++;
+  char *dc = (char *)d;
+  const char *sc = (const char *)s;
+  while (n--) *dc++ = *sc++;
+}
+
+static void px_fill(void *dst, uint8_t c, size_t n) {
+  uint64_t v = 0x0101010101010101ULL * c;
+  u64_unaligned *d = dst;
+  for (; n >= 32; n -= 32, d += 4) {
+    d[0] = v; d[1] = v; d[2] = v; d[3] = v;
+  }
+  for (; n >= 8; n -= 8) *d++ = v;
+  char *dc = (char *)d;
+  while (n--) *dc++ = c;
+}
+
 static void gpu_fbdraw(AM_GPU_FBDRAW_T *draw) {
   int x = draw->x, y = draw->y, w = draw->w, h = draw->h;
   int W = display.w, H = display.h;
   uint32_t *pixels = draw->pixels;
+  if (x >= W || y >= H) return;
   int len = (x + w >= W) ? W - x : w;
+  if (y + h > H) h = H - y;
+  if (len == W && w == W) { // whole rows: one contiguous run
+    px_convert(&fb[y * W], pixels, W * h);
+    return;
+  }
   for (int j = 0; j < h; j ++, pixels += w) {
-    if (y + j < H) {
-      struct pixel *px = &fb[x + (j + y) * W];
-      for (int i = 0; i < len; i ++, px ++) {
-        uint32_t p = pixels[i];
-        *px = (struct pixel) { .r = R(p), .g = G(p), .b = B(p) };
-      }
-    }
+    px_convert(&fb[x + (j + y) * W], pixels, len);
   }
 }
 
@@ -208,17 +277,14 @@ static void gpu_status(AM_GPU_STATUS_T *stat) {
 }
 
 static void gpu_memcpy(AM_GPU_MEMCPY_T *params) {
-  char *src = params->src, *dst = to_host(params->dest);
-  for (int i = 0; i < params->size; i++)
-    dst[i] = src[i];
+  px_copy(to_host(params->dest), params->src, params->size);
 }
 
 static void *vbuf_alloc(int size) {
   void *ret = vbuf_head;
   vbuf_head += size;
   panic_on(vbuf_head > vbuf + sizeof(vbuf), "no memory");
-  for (int i = 0; i < size; i++)
-    ((char *)ret)[i] = 0;
+  px_fill(ret, 0, size);
   return ret;
 }
 
@@ -244,12 +310,23 @@ static struct pixel *render(struct gpu_canvas *cv, struct gpu_canvas *parent, st
       panic("invalid node");
   }
 
-  // draw local canvas (w * h) -> px (x1, y1) - (x1 + w1, y1 + h1)
-  for (int i = 0; i < cv->w1; i++)
-    for (int j = 0; j < cv->h1; j++) {
-      int x = cv->x1 + i, y = cv->y1 + j;
-      px[W * y + x] = px_local[w * (j * h / cv->h1) + (i * w / cv->w1)];
+  // draw local canvas (w * h) -> px (x1, y1) - (x1 + w1, y1 + h1),
+  // stepping through the source in 16.16 fixed point instead of dividing
+  if (cv->w1 <= 0 || cv->h1 <= 0) return 0;
+  uint32_t dx = ((uint32_t)w << 16) / cv->w1, dy = ((uint32_t)h << 16) / cv->h1;
+  uint32_t sy = 0;
+  for (int j = 0; j < cv->h1; j++, sy += dy) {
+    struct pixel *drow = &px[W * (cv->y1 + j) + cv->x1];
+    struct pixel *srow = &px_local[w * (sy >> 16)];
+    if (w == cv->w1) {
+      px_copy(drow, srow, w * sizeof(struct pixel));
+      continue;
+    }
+    uint32_t sx = 0;
+    for (int i = 0; i < cv->w1; i++, sx += dx) {
+      drow[i] = srow[sx >> 16];
     }
+  }
   return 0;
 }
 
@@ -278,26 +355,33 @@ static inline void wait_disk(void) {
   while ((inb(0x1f7) & 0xc0) != 0x40);
 }
 
+// one command transfers up to 256 sectors (a sector count of 0 means 256)
 static void disk_blkio(AM_DISK_BLKIO_T *bio) {
   uint32_t blkno = bio->blkno, remain = bio->blkcnt;
   uint32_t *ptr = bio->buf;
-  for (remain = bio->blkcnt; remain; remain--, blkno++) {
+  while (remain) {
+    uint32_t n = remain > 256 ? 256 : remain;
     wait_disk();
-    outb(0x1f2, 1);
+    outb(0x1f2, n & 0xff);
     outb(0x1f3, blkno);
     outb(0x1f4, blkno >> 8);
     outb(0x1f5, blkno >> 16);
     outb(0x1f6, (blkno >> 24) | 0xe0);
     outb(0x1f7, bio->write? 0x30 : 0x20);
-    wait_disk();
-    if (bio->write) {
-      for (int i = 0; i < BLKSZ / 4; i ++)
-        outl(0x1f0, *ptr++);
-    } else {
-      for (int i = 0; i < BLKSZ / 4; i ++)
-        *ptr++ = inl(0x1f0);
+    for (int j = 0; j < n; j++) {
+      wait_disk();
+      if (bio->write) {
+        for (int i = 0; i < BLKSZ / 4; i ++)
+          outl(0x1f0, *ptr++);
+      } else {
+        for (int i = 0; i < BLKSZ / 4; i ++)
+          *ptr++ = inl(0x1f0);
+      }
     }
+    remain -= n;
+    blkno  += n;
   }
+  wait_disk();
 }
 
 // ====================================================
@@ -311,9 +395,12 @@ static void *lut[128] = {
   [AM_UART_CONFIG ] = uart_config,
   [AM_UART_TX     ] = uart_tx,
   [AM_UART_RX     ] = uart_rx,
+  [AM_UART_TXBUF  ] = uart_txbuf,
   [AM_TIMER_CONFIG] = timer_config,
   [AM_TIMER_RTC   ] = timer_rtc,
   [AM_TIMER_UPTIME] = timer_uptime,
+  [AM_TIMER_CTRL  ] = timer_ctrl,
+  [AM_TIMER_CYCLES] = timer_cycles,
   [AM_INPUT_CONFIG] = input_config,
   [AM_INPUT_KEYBRD] = input_keybrd,
   [AM_GPU_CONFIG  ] = gpu_config,
@@ -367,6 +454,7 @@ void ioe_write(int reg, void *buf) { ((handler_t)lut[reg])(buf); }
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
+  #define ONESHOT    0x00000000   // One-shot
   #define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -400,11 +488,13 @@ static void lapicw(int index, int value) {
   __am_lapic[ID];
 }
 
+#define TICR_DEFAULT 10000000  // the tick before the kernel programs AM_TIMER_CTRL
+
 void __am_percpu_initlapic(void) {
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
   lapicw(TDCR, X1);
   lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TICR, TICR_DEFAULT);
   lapicw(LINT0, MASKED);
   lapicw(LINT1, MASKED);
   if (((__am_lapic[VER]>>16) & 0xFF) >= 4)
@@ -419,11 +509,50 @@ void __am_percpu_initlapic(void) {
   lapicw(TPR, 0);
 }
 
+// count the LAPIC timer down (masked) for 10 ms of TSC time, then restore
+// the default periodic tick; the APs share the result
+static void lapic_calibrate() {
+  lapicw(TIMER, MASKED | ONESHOT);
+  lapicw(TICR, 0xffffffff);
+  uint64_t t0 = rdtsc();
+  while (rdtsc() - t0 < tsc_hz / 100) ;
+  lapic_hz = (uint64_t)(0xffffffff - __am_lapic[TCCR]) * 100;
+  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, TICR_DEFAULT);
+}
+
+// the timer of this cpu; a one-shot count beyond 32 bits is cut short,
+// which only costs an early interrupt
+static void timer_ctrl(AM_TIMER_CTRL_T *ctl) {
+  if (ctl->hz > 0) {
+    lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, lapic_hz / ctl->hz ? lapic_hz / ctl->hz : 1);
+    return;
+  }
+  lapicw(TIMER, ONESHOT | (T_IRQ0 + IRQ_TIMER));
+  if (ctl->deadline == 0) {
+    lapicw(TICR, 0);  // stops the timer
+    return;
+  }
+  AM_TIMER_UPTIME_T now;
+  timer_uptime(&now);
+  uint64_t us = ctl->deadline > now.us ? ctl->deadline - now.us : 0;
+  if (us > 60000000) us = 60000000;
+  uint64_t cnt = us * lapic_hz / 1000000;
+  lapicw(TICR, cnt == 0 ? 1 : cnt > 0xffffffff ? 0xffffffff : cnt);
+}
+
 void __am_lapic_eoi(void) {
   if (__am_lapic)
     lapicw(EOI, 0);
 }
 
+void __am_lapic_ipi(int cpu, int vector) {
+  lapicw(ICRHI, cpu<<24);
+  lapicw(ICRLO, FIXED | vector);
+  while(__am_lapic[ICRLO] & DELIVS) ;
+}
+
 void __am_lapic_bootap(uint32_t apicid, void *addr) {
   int i;
   uint16_t *wrv;
@@ -465,7 +594,13 @@ void __am_ioapic_init(void) {
   }
 }
 
+// the APs come up concurrently and each routes the IRQs again; the
+// register select and data window must not interleave
+static int ioapic_lock = 0;
+
 void __am_ioapic_enable(int irq, int cpunum) {
+  while (xchg(&ioapic_lock, 1)) pause();
   ioapicwrite(REG_TABLE+2*irq, T_IRQ0 + irq);
   ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
+  xchg(&ioapic_lock, 0);
 }
@@ -2,30 +2,54 @@
 
 struct cpu_local __am_cpuinfo[MAX_CPU] = {};
 static void (* volatile user_entry)();
-static int ap_ready = 0;
+static volatile int ap_online = 0, ap_go = 0;
 
 static void call_user_entry() {
   user_entry();
   panic("MPE entry should not return");
 }
 
+static void put_dec(uint64_t x) {
+  char num[24], *p = num + sizeof(num);
+  *--p = '\0';
+  do { *--p = '0' + x % 10; x /= 10; } while (x);
+  for (; *p; p++) putch(*p);
+}
+
+static void print_online(int ncpu, uint64_t us) {
+  for (const char *s = "MPE: "; *s; s++) putch(*s);
+  put_dec(ncpu);
+  for (const char *s = " CPUs online in "; *s; s++) putch(*s);
+  put_dec(us);
+  for (const char *s = " us\n"; *s; s++) putch(*s);
+}
+
+// All APs are started at once: each has its own early stack (picked by
+// LAPIC ID in boot/start.S) and its own CPU slot, so nothing is shared
+// until the barrier, where they wait for each other before the entry.
 bool mpe_init(void (*entry)()) {
   user_entry = entry;
+  uint64_t t0 = __am_timer_us();
   boot_record()->jmp_code = 0x000bfde9; // (16-bit) jmp (0x7c00)
+  boot_record()->is_ap = 1;
   for (int cpu = 1; cpu < __am_ncpu; cpu++) {
-    boot_record()->is_ap = 1;
     __am_lapic_bootap(cpu, (void *)boot_record());
-    while (xchg(&ap_ready, 0) != 1) {
-      pause();
-    }
   }
+  while (ap_online != __am_ncpu - 1) {
+    pause();
+  }
+  print_online(__am_ncpu, __am_timer_us() - t0);
+  ap_go = 1;
   call_user_entry();
   return true;
 }
 
 static void othercpu_entry() {
   __am_percpu_init();
-  xchg(&ap_ready, 1);
+  __sync_fetch_and_add(&ap_online, 1);
+  while (!ap_go) {
+    pause();
+  }
   call_user_entry();
 }
 
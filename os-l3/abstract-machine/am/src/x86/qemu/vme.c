@@ -36,9 +36,42 @@ static const struct vm_area vm_areas[] = {
 static uintptr_t *kpt;
 static void *(*pgalloc)(int size);
 static void (*pgfree)(void *);
+static int pcid_enabled;
 
+// Address spaces are told apart by their root page table. Every root hashes to
+// a generation that is bumped whenever one of its translations is revoked; a
+// CPU compares it with the generation its PCID slot was filled at, and drops
+// the tagged entries when they differ.
+#define NR_GEN 64
+static volatile uint32_t as_gen[NR_GEN];
+#define GEN(root) (&as_gen[((root) >> 12) % NR_GEN])
+
+// One bit per group of entries of every page-table page (64 groups per table),
+// set when an entry of the group may be non-zero. Indexed by the table's page
+// in the heap, it lets teardown() skip the empty parts of a table.
+static uint64_t *occupancy;
+
+static uint64_t *occof(uintptr_t *pt) {
+  if (!occupancy || !IN_RANGE((void *)pt, heap)) return NULL;
+  return &occupancy[((uintptr_t)pt - (uintptr_t)heap.start) / mmu.pgsize];
+}
+
+static void setpte(uintptr_t *pt, int index, uintptr_t pte, int level) {
+  uint64_t *occ = occof(pt);
+  pt[index] = pte;
+  if (occ) *occ |= 1ULL << (index / ((1 << mmu.pgtables[level].bits) / 64));
+}
+
+// Page-table pages are taken from and returned to a per-CPU cache of zeroed
+// pages; teardown() leaves every table it frees zeroed again.
 static void *pgallocz() {
-  uintptr_t *base = pgalloc(mmu.pgsize);
+  bool enabled = ienabled();
+  iset(false);
+  uintptr_t *base = CPU->ptcache_nr > 0 ? CPU->ptcache[--CPU->ptcache_nr] : NULL;
+  iset(enabled);
+  if (base) return base;
+
+  base = pgalloc(mmu.pgsize);
   panic_on(!base, "cannot allocate page");
   for (int i = 0; i < mmu.pgsize / sizeof(uintptr_t); i++) {
     base[i] = 0;
@@ -46,6 +79,17 @@ static void *pgallocz() {
   return base;
 }
 
+static void pgfreez(uintptr_t *pt) {
+  bool enabled = ienabled();
+  iset(false);
+  if (CPU->ptcache_nr < NR_PTCACHE) {
+    CPU->ptcache[CPU->ptcache_nr++] = pt;
+    pt = NULL;
+  }
+  iset(enabled);
+  if (pt) pgfree(pt);
+}
+
 static int indexof(uintptr_t addr, const struct ptinfo *info) {
   return ((uintptr_t)addr & info->mask) >> info->shift;
 }
@@ -54,18 +98,21 @@ static uintptr_t baseof(uintptr_t addr) {
   return addr & ~(mmu.pgsize - 1);
 }
 
-static uintptr_t *ptwalk(AddrSpace *as, uintptr_t addr, int flags) {
+// walk the page table down to @level and return the entry at that level;
+// stops early at a huge page (PTE_PS) entry
+static uintptr_t *ptwalk(AddrSpace *as, uintptr_t addr, int flags, int level) {
   uintptr_t cur = (uintptr_t)&as->ptr;
 
-  for (int i = 0; i <= mmu.ptlevels; i++) {
+  for (int i = 0; i <= level; i++) {
     const struct ptinfo *ptinfo = &mmu.pgtables[i];
     uintptr_t *pt = (uintptr_t *)cur, next_page;
     int index = indexof(addr, ptinfo);
-    if (i == mmu.ptlevels) return &pt[index];
+    if (i == level || (i > 0 && (pt[index] & PTE_PS))) return &pt[index];
 
     if (!(pt[index] & PTE_P)) {
       next_page = (uintptr_t)pgallocz();
-      pt[index] = next_page | PTE_P | flags;
+      if (i > 0) setpte(pt, index, next_page | PTE_P | flags, i);
+      else       pt[index] = next_page | PTE_P | flags;
     } else {
       next_page = baseof(pt[index]);
     }
@@ -75,15 +122,25 @@ static uintptr_t *ptwalk(AddrSpace *as, uintptr_t addr, int flags) {
 }
 
 static void teardown(int level, uintptr_t *pt) {
-  if (level > mmu.ptlevels) return;
-  for (int index = 0; index < (1 << mmu.pgtables[level].bits); index++) {
-    if ((pt[index] & PTE_P) && (pt[index] & PTE_U)) {
-      teardown(level + 1, (void *)baseof(pt[index]));
-    }
+  if (level == 0) {
+    if ((*pt & PTE_P) && (*pt & PTE_U)) teardown(1, (void *)baseof(*pt));
+    return;
   }
-  if (level >= 1) {
-    pgfree(pt);
+  // only the groups that may hold entries are visited, and cleared on the way
+  uint64_t *occ = occof(pt), groups = occ ? *occ : ~0ULL;
+  int group = (1 << mmu.pgtables[level].bits) / 64;
+  for (; groups; groups &= groups - 1) {
+    int first = __builtin_ctzll(groups) * group;
+    for (int index = first; index < first + group; index++) {
+      uintptr_t pte = pt[index];
+      if (level < mmu.ptlevels && (pte & PTE_P) && (pte & PTE_U) && !(pte & PTE_PS)) {
+        teardown(level + 1, (void *)baseof(pte));
+      }
+      pt[index] = 0;
+    }
   }
+  if (occ) *occ = 0;
+  pgfreez(pt);
 }
 
 bool vme_init(void *(*_pgalloc)(int size), void (*_pgfree)(void *)) {
@@ -91,6 +148,13 @@ bool vme_init(void *(*_pgalloc)(int size), void (*_pgfree)(void *)) {
   pgalloc = _pgalloc;
   pgfree  = _pgfree;
 
+  int npages = ((uintptr_t)heap.end - (uintptr_t)heap.start) / mmu.pgsize + 1;
+  occupancy = pgalloc(npages * sizeof(uint64_t));
+  panic_on(!occupancy, "cannot allocate page-table occupancy map");
+  for (int i = 0; i < npages; i++) {
+    occupancy[i] = 0;
+  }
+
 #if __x86_64__
   kpt = (void *)PML4_ADDR;
 #else
@@ -102,7 +166,7 @@ bool vme_init(void *(*_pgalloc)(int size), void (*_pgfree)(void *)) {
       for (uintptr_t cur = (uintptr_t)vma->area.start;
            cur != (uintptr_t)vma->area.end;
            cur += mmu.pgsize) {
-        *ptwalk(&as, cur, PTE_W) = cur | PTE_P | PTE_W;
+        *ptwalk(&as, cur, PTE_W, mmu.ptlevels) = cur | PTE_P | PTE_W;
       }
     }
   }
@@ -111,9 +175,117 @@ bool vme_init(void *(*_pgalloc)(int size), void (*_pgfree)(void *)) {
 
   set_cr3(kpt);
   set_cr0(get_cr0() | CR0_PG);
+
+#if __x86_64__
+  uint32_t regs[4];
+  cpuid(1, 0, regs);
+  pcid_enabled = (regs[2] >> 17) & 1; // CPUID.01H:ECX.PCID
+#endif
+  __am_percpu_initpcid();
   return true;
 }
 
+void __am_percpu_initpcid() {
+  // CR3[11:0] must be zero here: the boot page table is loaded with PCID 0
+  if (pcid_enabled) {
+    set_cr4(get_cr4() | CR4_PCIDE);
+  }
+}
+
+static void lock(int *lk)   { while (xchg(lk, 1)) pause(); }
+static void unlock(int *lk) { xchg(lk, 0); }
+
+static void tlb_invalidate(uintptr_t root, uintptr_t va) {
+  __sync_fetch_and_add(GEN(root), 1);
+  __sync_synchronize(); // pairs with __am_switch_as(): one of us sees the other
+
+  bool enabled = ienabled();
+  iset(false);
+  int self = cpu_current();
+  if (CPU->cr3 == root) invlpg(va);
+  for (int cpu = 0; cpu < __am_ncpu; cpu++) {
+    struct cpu_local *c = &__am_cpuinfo[cpu];
+    if (cpu == self || c->cr3 != root) continue;
+    lock(&c->tlb.lock);
+    if (c->tlb.nr < TLB_BATCH) {
+      c->tlb.req[c->tlb.nr].root = root;
+      c->tlb.req[c->tlb.nr].va   = va;
+    }
+    if (c->tlb.nr <= TLB_BATCH) c->tlb.nr++;
+    unlock(&c->tlb.lock);
+    CPU->tlb_pending |= 1u << cpu;
+  }
+  iset(enabled);
+}
+
+// Apply the invalidations other CPUs queued for us. Requests for a root that is
+// not loaded any more are dropped: its generation has already moved on.
+void __am_tlb_shootdown() {
+  struct tlb_batch *b = &CPU->tlb;
+  lock(&b->lock);
+  if (b->nr > TLB_BATCH) {
+    uintptr_t cr3 = get_cr3();
+    set_cr3((void *)cr3); // flushes the non-global entries of the current PCID
+  } else {
+    for (int i = 0; i < b->nr; i++) {
+      if (b->req[i].root == CPU->cr3) invlpg(b->req[i].va);
+    }
+  }
+  b->nr = 0;
+  unlock(&b->lock);
+}
+
+// Deliver the invalidations queued by this CPU in one IPI per target and wait
+// until they are applied. Called with interrupts disabled before leaving a trap.
+void __am_tlb_flush() {
+  uint32_t pending = CPU->tlb_pending;
+  if (!pending) return;
+  CPU->tlb_pending = 0;
+  for (int cpu = 0; cpu < __am_ncpu; cpu++) {
+    if (pending & (1u << cpu)) __am_lapic_ipi(cpu, T_IRQ0 + IRQ_TLB);
+  }
+  for (int cpu = 0; cpu < __am_ncpu; cpu++) {
+    if (!(pending & (1u << cpu))) continue;
+    while (((volatile struct tlb_batch *)&__am_cpuinfo[cpu].tlb)->nr) {
+      __am_tlb_shootdown(); // the target may be waiting for us as well
+      pause();
+    }
+  }
+}
+
+void __am_switch_as(void *cr3) {
+  uintptr_t root = baseof((uintptr_t)cr3);
+  if (!pcid_enabled) {
+    CPU->cr3 = root;
+    set_cr3((void *)root);
+    return;
+  }
+
+  CPU->cr3 = root;
+  __sync_synchronize();
+  uint32_t gen = *GEN(root);
+
+  int slot = -1;
+  for (int i = 0; i < NR_PCID; i++) {
+    if (CPU->pcid[i].root == root) slot = i;
+  }
+  bool noflush = slot >= 0 && CPU->pcid[slot].gen == gen;
+  if (slot < 0) {
+    slot = CPU->pcid_next;
+    CPU->pcid_next = (slot + 1) % NR_PCID;
+    CPU->pcid[slot].root = root;
+  }
+  CPU->pcid[slot].gen = gen;
+
+  // PCID 0 belongs to the kernel page table
+  uintptr_t val = root | (slot + 1);
+  if (noflush) {
+    if (get_cr3() == val) return; // still loaded, nothing to do
+    val |= CR3_NOFLUSH;
+  }
+  set_cr3((void *)val);
+}
+
 void protect(AddrSpace *as) {
   uintptr_t *upt = pgallocz();
 
@@ -125,7 +297,7 @@ void protect(AddrSpace *as) {
            cur != (uintptr_t)vma->area.end;
            cur += (1L << info->shift)) {
         int index = indexof(cur, info);
-        upt[index] = kpt[index];
+        setpte(upt, index, kpt[index], 1);
       }
     }
   }
@@ -135,24 +307,39 @@ void protect(AddrSpace *as) {
 }
 
 void unprotect(AddrSpace *as) {
+  uintptr_t root = baseof((uintptr_t)as->ptr);
   teardown(0, (void *)&as->ptr);
+  // the root may be reused by another address space: forget its tagged entries
+  __sync_fetch_and_add(GEN(root), 1);
 }
 
 void map(AddrSpace *as, void *va, void *pa, int prot) {
+  int huge = prot & MMAP_HUGE;
+  // a huge page is mapped by an entry of the last-but-one level (PD on x86_64)
+  int level = huge ? mmu.ptlevels - 1 : mmu.ptlevels;
+  uintptr_t size = 1L << mmu.pgtables[level].shift;
+  prot &= ~MMAP_HUGE;
+
+#if !__x86_64__
+  panic_on(huge, "huge pages are not supported");
+#endif
   panic_on(!IN_RANGE(va, uvm_area), "mapping an invalid address");
-  panic_on((uintptr_t)va != ROUNDDOWN(va, mmu.pgsize) ||
-           (uintptr_t)pa != ROUNDDOWN(pa, mmu.pgsize), "non-page-boundary address");
+  panic_on((uintptr_t)va != ROUNDDOWN(va, size) ||
+           (uintptr_t)pa != ROUNDDOWN(pa, size), "non-page-boundary address");
 
-  uintptr_t *ptentry = ptwalk(as, (uintptr_t)va, PTE_W | PTE_U);
+  uintptr_t *ptentry = ptwalk(as, (uintptr_t)va, PTE_W | PTE_U, level);
+  panic_on(!huge != !(*ptentry & PTE_PS) && (*ptentry & PTE_P), "page size mismatch");
   if (prot == MMAP_NONE) {
     panic_on(!(*ptentry & PTE_P), "unmapping a non-mapped page");
     *ptentry = 0;
+    tlb_invalidate(baseof((uintptr_t)as->ptr), (uintptr_t)va);
   } else {
     panic_on(*ptentry & PTE_P, "remapping a mapped page");
     uintptr_t pte = (uintptr_t)pa | PTE_P | PTE_U | ((prot & MMAP_WRITE) ? PTE_W : 0);
-    *ptentry = pte;
+    setpte((uintptr_t *)baseof((uintptr_t)ptentry), ptentry - (uintptr_t *)baseof((uintptr_t)ptentry),
+           pte | (huge ? PTE_PS : 0), level);
   }
-  ptwalk(as, (uintptr_t)va, PTE_W | PTE_U);
+  if (!huge) ptwalk(as, (uintptr_t)va, PTE_W | PTE_U, level);
 }
 
 Context *ucontext(AddrSpace *as, Area kstack, void *entry) {
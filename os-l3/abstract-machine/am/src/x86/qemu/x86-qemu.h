@@ -41,8 +41,24 @@ struct vm_area {
 
 void __am_iret(Context *ctx);
 
+#define NR_PCID    8   // address spaces kept tagged in the TLB per CPU
+#define TLB_BATCH  16  // queued invalidations before falling back to a full flush
+#define NR_PTCACHE 32  // zeroed page-table pages cached per CPU
+
+struct tlb_batch {
+  int lock, nr;        // nr > TLB_BATCH: flush everything
+  struct { uintptr_t root, va; } req[TLB_BATCH];
+};
+
 struct cpu_local {
   AddrSpace *uvm;
+  volatile uintptr_t cr3;  // root of the loaded page table (without PCID)
+  struct { uintptr_t root; uint32_t gen; } pcid[NR_PCID];
+  int pcid_next;
+  struct tlb_batch tlb;    // invalidations queued by other CPUs
+  volatile uint32_t tlb_pending; // CPUs this CPU has queued invalidations for
+  void *ptcache[NR_PTCACHE];
+  int ptcache_nr;
 #if __x86_64__
   SegDesc gdt[NR_SEG + 1];
   TSS64 tss;
@@ -85,6 +101,13 @@ void __am_lapic_eoi();
 void __am_ioapic_init();
 void __am_lapic_bootap(uint32_t cpu, void *address);
 void __am_ioapic_enable(int irq, int cpu);
+void __am_lapic_ipi(int cpu, int vector);
+uint64_t __am_timer_us();
+
+// TLB management (vme.c)
+void __am_switch_as(void *cr3);
+void __am_tlb_flush();
+void __am_tlb_shootdown();
 
 // x86-specific operations
 void __am_bootcpu_init();
@@ -95,6 +118,7 @@ void __am_othercpu_entry();
 void __am_percpu_initirq();
 void __am_percpu_initgdt();
 void __am_percpu_initlapic();
+void __am_percpu_initpcid();
 void __am_stop_the_world();
 
 #endif
@@ -19,6 +19,8 @@
 #define CR0_PE         0x00000001  // Protection Enable
 #define CR0_PG         0x80000000  // Paging
 #define CR4_PAE        0x00000020  // Physical Address Extension
+#define CR4_PCIDE      0x00020000  // Process-Context Identifiers Enable
+#define CR3_NOFLUSH    (1ULL << 63) // Keep TLB entries of the new PCID
 
 // Page table/directory entry flags
 #define PTE_P          0x001   // Present
@@ -35,6 +37,7 @@
 #define IRQ_TIMER      0
 #define IRQ_KBD        1
 #define IRQ_COM1       4
+#define IRQ_TLB        16      // TLB shootdown IPI (never routed by IOAPIC)
 #define IRQ_ERROR      19
 #define IRQ_SPURIOUS   31
 #define EX_DE          0
@@ -87,6 +90,7 @@
   _( 45, KERN, NOERR) \
   _( 46, KERN, NOERR) \
   _( 47, KERN, NOERR) \
+  _( 48, KERN, NOERR) \
   _(128, USER, NOERR) \
   _(129, USER, NOERR)
 
@@ -280,6 +284,16 @@ static inline void set_cr0(uintptr_t cr0) {
   asm volatile ("mov %0, %%cr0" : : "r"(cr0));
 }
 
+static inline uintptr_t get_cr4(void) {
+  volatile uintptr_t val;
+  asm volatile ("mov %%cr4, %0" : "=r"(val));
+  return val;
+}
+
+static inline void set_cr4(uintptr_t cr4) {
+  asm volatile ("mov %0, %%cr4" : : "r"(cr4));
+}
+
 static inline void set_idt(void *idt, int size) {
   static volatile struct {
     int16_t size;
@@ -320,6 +334,16 @@ static inline void set_cr3(void *pdir) {
   asm volatile ("mov %0, %%cr3" : : "r"(pdir));
 }
 
+static inline void invlpg(uintptr_t va) {
+  asm volatile ("invlpg (%0)" : : "r"(va) : "memory");
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+  asm volatile ("cpuid"
+    : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+    : "a"(leaf), "c"(subleaf));
+}
+
 static inline int xchg(int *addr, int newval) {
   int result;
   asm volatile ("lock xchg %0, %1":
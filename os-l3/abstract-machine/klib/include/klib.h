@@ -22,12 +22,17 @@ char  *strcpy    (char *dst, const char *src);
 char  *strncpy   (char *dst, const char *src, size_t n);
 int    strcmp    (const char *s1, const char *s2);
 int    strncmp   (const char *s1, const char *s2, size_t n);
+void   copy_page (void *dst, const void *src, size_t size);
+void   zero_page (void *dst, size_t size);
 
 // stdlib.h
 void   srand     (unsigned int seed);
 int    rand      (void);
 void  *malloc    (size_t size);
 void   free      (void *ptr);
+void  *calloc    (size_t nmemb, size_t size);
+void  *realloc   (void *ptr, size_t size);
+size_t malloc_footprint(void);
 int    abs       (int x);
 int    atoi      (const char *nptr);
 
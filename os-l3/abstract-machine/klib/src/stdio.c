@@ -27,15 +27,64 @@ static int get_wid(const char **s) {
     return i;
 }
 
-static char *number_to_string(char *str, long num, int base, int size, int type) {
-    char *dig = "0123456789abcdefghijklmnopqrstuvwxyz";
-    char c, sign, temp[70];
-    int i = 0;
+// 有界的输出: 超出 n 的部分只计数不写入, 返回值是完整输出时的长度
+typedef struct {
+    char *buf;
+    size_t n, pos;  // n 已经为结尾的 '\0' 预留了位置
+} out_t;
+
+static inline void out_putc(out_t *o, char c) {
+    if (o->pos < o->n) o->buf[o->pos] = c;
+    o->pos++;
+}
+
+static inline void out_pad(out_t *o, char c, int cnt) {
+    while (cnt-- > 0) out_putc(o, c);
+}
+
+static const char dig100[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// 从 end 往前写数字: 十进制每次两位查表, 二的幂进制用移位和掩码
+static char *utoa_rev(char *end, unsigned long num, int base) {
+    static const char dig[] = "0123456789abcdef";
+    char *p = end;
+    if (base == 10) {
+        while (num >= 100) {
+            unsigned r = num % 100;
+            num /= 100;
+            p -= 2;
+            p[0] = dig100[2 * r];
+            p[1] = dig100[2 * r + 1];
+        }
+        if (num >= 10) {
+            p -= 2;
+            p[0] = dig100[2 * num];
+            p[1] = dig100[2 * num + 1];
+        } else {
+            *--p = '0' + num;
+        }
+    } else {
+        int shift = (base == 16) ? 4 : 3;
+        do {
+            *--p = dig[num & (base - 1)];
+            num >>= shift;
+        } while (num != 0);
+    }
+    return p;
+}
+
+static void number_to_string(out_t *o, unsigned long num, int base, int size, int type) {
+    char c, sign, temp[24];
     c = (type & ZEROPAD) ? '0' : ' ';  // 是否补充前导 0
     sign = 0;
 
     if (type & SIGN) {
-        if (num < 0) {
+        if ((long)num < 0) {
             num = -num;
             sign = '-';
             size--;
@@ -48,28 +97,23 @@ static char *number_to_string(char *str, long num, int base, int size, int type)
         }
     }
 
-    if (num == 0) {
-        temp[i++] = '0';
-    } else {
-        while (num != 0) {
-            temp[i++] = dig[((unsigned long)num) % (unsigned)base];
-            num = ((unsigned long)num) / (unsigned)base;
-        }
-    }
-
+    char *end = temp + sizeof(temp), *p = utoa_rev(end, num, base);
+    int i = end - p;
     size -= i;
 
-    if (!(type & (ZEROPAD | LEFT)))
-        while (size-- > 0) *str++ = ' ';
-
-    if (sign) *str++ = sign;
+    if (!(type & (ZEROPAD | LEFT))) {
+        out_pad(o, ' ', size);
+        size = 0;
+    }
 
-    if (!(type & LEFT))
-        while (size-- > 0) *str++ = c;  // 补充前导(0或者space)
-    while (i-- > 0) *str++ = temp[i];
-    while (size-- > 0) *str++ = ' ';
+    if (sign) out_putc(o, sign);
 
-    return str;
+    if (!(type & LEFT)) {
+        out_pad(o, c, size);  // 补充前导(0或者space)
+        size = 0;
+    }
+    for (; p < end; p++) out_putc(o, *p);
+    out_pad(o, ' ', size);
 }
 
 /*static char *number_to_string(char *str, long num, int base, int size, int type){
@@ -103,29 +147,44 @@ static char *number_to_string(char *str, long num, int base, int size, int type)
     return str;
 
 }*/
+// 控制台输出: 每次 printf 格式化好的整段文字在一把全局锁下用 AM_UART_TXBUF
+// 一次写出, 多个 CPU 的输出不会逐字符交错. 调用返回时文字已经全部写出,
+// 不会留在缓冲里, 与 putch/putstr (panic, halt) 的直接输出保持先后顺序.
+static int cons_lock;
+
+static void cons_puts(const char *s) {
+    bool enable = ienabled();
+    iset(false);  // 同一 CPU 上的中断处理程序也可能调用 printf
+    while (atomic_xchg(&cons_lock, 1))
+        ;
+    io_write(AM_UART_TXBUF, s, strlen(s));
+    atomic_xchg(&cons_lock, 0);
+    if (enable) iset(true);
+}
+
 int printf(const char *fmt, ...) {
     char out[2048];
     va_list va;
     va_start(va, fmt);
-    int ret = vsprintf(out, fmt, va);
+    int ret = vsnprintf(out, sizeof(out), fmt, va);
     va_end(va);
-    putstr(out);
+    cons_puts(out);
     return ret;
 }
 
-int vsprintf(char *buf, const char *fmt, va_list ap) {
-    int len, i;  // 长度
+int vsnprintf(char *buf, size_t n, const char *fmt, va_list ap) {
+    out_t o = { .buf = buf, .n = n ? n - 1 : 0, .pos = 0 };
     unsigned long num;
-    char *str;
-    char *s;
+    const char *s;
     int flags = 0;      // 用来指示类型
-    int integer_width;  // 整数的长度 如%8d, 8为精度; qualifier: h(短整)或者l(长整)
+    int integer_width;  // 整数的长度 如%8d, 8为精度
+    int qualifier;      // l(长整) 或者 z(size_t)
     int base;           // 进制
 
-    for (str = buf; *fmt; fmt++) {
+    for (; *fmt; fmt++) {
         // 还没有出现需要转化的常规字符
         if (*fmt != '%') {
-            *str++ = *fmt;
+            out_putc(&o, *fmt);
             continue;
         }
         flags = 0;
@@ -154,6 +213,12 @@ int vsprintf(char *buf, const char *fmt, va_list ap) {
             integer_width = get_wid(&fmt);
         }
 
+        qualifier = 0;
+        while (*fmt == 'l' || *fmt == 'z') {  // long 与 size_t 都是 64 位
+            qualifier = 'l';
+            fmt++;
+        }
+
         base = 10;  // 默认基
         switch (*fmt) {
             // 指针
@@ -162,20 +227,28 @@ int vsprintf(char *buf, const char *fmt, va_list ap) {
                     integer_width = 2 * sizeof(void *);
                     flags |= ZEROPAD;
                 }
-                *str++ = '0', *str++ = 'x';
-                str = number_to_string(str, (unsigned long)va_arg(ap, void *), 16, integer_width, flags);
+                out_putc(&o, '0'), out_putc(&o, 'x');
+                number_to_string(&o, (unsigned long)va_arg(ap, void *), 16, integer_width, flags);
                 continue;
             // 单字符
             case 'c':
-                *str++ = (unsigned char)va_arg(ap, int);
+                out_putc(&o, (unsigned char)va_arg(ap, int));
                 continue;  // 跳到最外层的for循环
             // 字符串
             case 's':
                 s = va_arg(ap, char *);
                 if (!s) s = "<NULL>";
-                len = my_strlen(s);
-                for (i = 0; i < len; ++i) *str++ = *s++;
+                if (flags & LEFT) {
+                    for (; *s; s++, integer_width--) out_putc(&o, *s);
+                    out_pad(&o, ' ', integer_width);
+                } else {
+                    out_pad(&o, ' ', integer_width - (int)my_strlen(s));
+                    for (; *s; s++) out_putc(&o, *s);
+                }
                 continue;  // 跳到最外层的for循环
+            case '%':
+                out_putc(&o, '%');
+                continue;
 
             case 'o':
                 base = 8;
@@ -190,27 +263,26 @@ int vsprintf(char *buf, const char *fmt, va_list ap) {
 
             default:
                 panic("Not implemented");
-                if (*fmt != '%') *str++ = '%';
-                if (*fmt) {
-                    *str++ = *fmt;
-                } else {
-                    --fmt;
-                }
-                continue;
         }
 
         // 如果是整型,分两种情况:带不带符号
-        if (flags & SIGN) {
+        if (qualifier == 'l') {
+            num = va_arg(ap, unsigned long);
+        } else if (flags & SIGN) {
             num = va_arg(ap, int);
         } else {
             num = va_arg(ap, unsigned int);
         }
 
         // 将数字转化为字符
-        str = number_to_string(str, num, base, integer_width, flags);
+        number_to_string(&o, num, base, integer_width, flags);
     }
-    *str = '\0';
-    return str - buf;
+    if (n > 0) buf[o.pos < o.n ? o.pos : o.n] = '\0';
+    return o.pos;
+}
+
+int vsprintf(char *buf, const char *fmt, va_list ap) {
+    return vsnprintf(buf, (size_t)-1 >> 1, fmt, ap);
 }
 
 /*int vsprintf(char *buf, const char *fmt, va_list ap) {
@@ -281,8 +353,12 @@ int sprintf(char *out, const char *fmt, ...) {
     return ret;
 }
 
-int snprintf(char *out, size_t n, const char *fmt, ...) { panic("Not implemented"); }
-
-int vsnprintf(char *out, size_t n, const char *fmt, va_list ap) { panic("Not implemented"); }
+int snprintf(char *out, size_t n, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    int ret = vsnprintf(out, n, fmt, va);
+    va_end(va);
+    return ret;
+}
 
 #endif
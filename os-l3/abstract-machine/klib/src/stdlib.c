@@ -27,18 +27,187 @@ int atoi(const char* nptr) {
     return x;
 }
 
+// 堆分配器: 分离空闲链表 (按 2 的幂分组) + 边界标记合并, 第一次调用时才接管 heap.
+// 每个块头尾各有一个字 size | USED, 空闲块在负载中存放双向链表指针.
+// 块的起始地址 = -HDR (mod ALIGN), 大小是 ALIGN 的倍数, 所以返回的地址按 ALIGN 对齐.
+#define USED    1UL
+#define HDR     sizeof(size_t)
+#define ALIGN   16
+#define MINBLK  32
+#define NBIN    32
+
+typedef struct fblock {
+    size_t hdr;
+    struct fblock *prev, *next;
+} fblock_t;
+
+static fblock_t *bins[NBIN];
+static uint32_t bin_map;     // 非空链表的位图
+static int heap_lock, heap_ready;
+static char *heap_lo, *heap_hi, *heap_peak;
+
+#define SIZE(b)      ((b)->hdr & ~(size_t)(ALIGN - 1))
+#define FTR(b, sz)   (*(size_t *)((char *)(b) + (sz) - HDR))
+#define NEXTBLK(b)   ((fblock_t *)((char *)(b) + SIZE(b)))
+
+static inline int bin_of(size_t sz) {
+    int i = (int)(8 * sizeof(long)) - 1 - __builtin_clzl(sz) - 5;  // MINBLK 落在 0 号链表
+    return i < NBIN ? i : NBIN - 1;
+}
+
+static inline void set_blk(fblock_t *b, size_t sz, size_t used) {
+    b->hdr = sz | used;
+    FTR(b, sz) = sz | used;
+}
+
+static void bin_insert(fblock_t *b) {
+    int i = bin_of(SIZE(b));
+    b->prev = NULL;
+    b->next = bins[i];
+    if (bins[i]) bins[i]->prev = b;
+    bins[i] = b;
+    bin_map |= 1u << i;
+}
+
+static void bin_remove(fblock_t *b) {
+    int i = bin_of(SIZE(b));
+    if (b->prev) b->prev->next = b->next;
+    else bins[i] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    if (!bins[i]) bin_map &= ~(1u << i);
+}
+
+// 头部是一个已使用的尾标记 (prologue), 末尾是大小为 0 的已使用块 (epilogue).
+// prologue 放在第一个块之前, 使第一个块的负载从 lo + ALIGN 开始 (HDR 是 4 时前面留空)
+static void heap_init() {
+    char *lo = (char *)ROUNDUP(heap.start, ALIGN), *hi = (char *)ROUNDDOWN(heap.end, ALIGN) - HDR;
+    *(size_t *)(lo + ALIGN - 2 * HDR) = USED;
+    fblock_t *b = (fblock_t *)(lo + ALIGN - HDR);
+    set_blk(b, hi - (char *)b, 0);
+    *(size_t *)hi = USED;
+    bin_insert(b);
+    heap_lo = heap_peak = lo;
+    heap_hi = hi;
+    heap_ready = 1;
+}
+
+// 从空闲块 b 的头部切出 sz 字节, 剩余部分放回空闲链表
+static void *take(fblock_t *b, size_t sz) {
+    size_t bsz = SIZE(b);
+    bin_remove(b);
+    if (bsz - sz >= MINBLK) {
+        fblock_t *rest = (fblock_t *)((char *)b + sz);
+        set_blk(rest, bsz - sz, 0);
+        bin_insert(rest);
+    } else {
+        sz = bsz;
+    }
+    set_blk(b, sz, USED);
+    if ((char *)b + sz > heap_peak) heap_peak = (char *)b + sz;
+    return (char *)b + HDR;
+}
+
+static inline size_t blk_size(size_t size) {
+    size_t sz = ROUNDUP(size + 2 * HDR, ALIGN);
+    return sz < MINBLK ? MINBLK : sz;
+}
+
+static void *malloc_locked(size_t size) {
+    if (!heap_ready) heap_init();
+    if (size > (size_t)(heap_hi - heap_lo)) return NULL;
+    size_t sz = blk_size(size);
+    int i = bin_of(sz);
+    // 本组内首次适配; 更大的组里任何一块都够用
+    for (fblock_t *b = bins[i]; b; b = b->next)
+        if (SIZE(b) >= sz) return take(b, sz);
+    uint32_t m = (i + 1 < NBIN) ? bin_map >> (i + 1) << (i + 1) : 0;
+    if (!m) return NULL;
+    return take(bins[__builtin_ctz(m)], sz);
+}
+
+static void free_locked(void *ptr) {
+    fblock_t *b = (fblock_t *)((char *)ptr - HDR);
+    size_t sz = SIZE(b);
+    fblock_t *nb = (fblock_t *)((char *)b + sz);
+    if (!(nb->hdr & USED)) {
+        bin_remove(nb);
+        sz += SIZE(nb);
+    }
+    size_t pf = *(size_t *)((char *)b - HDR);
+    if (!(pf & USED)) {
+        fblock_t *pb = (fblock_t *)((char *)b - (pf & ~(size_t)(ALIGN - 1)));
+        bin_remove(pb);
+        sz += SIZE(pb);
+        b = pb;
+    }
+    set_blk(b, sz, 0);
+    bin_insert(b);
+}
+
+static inline void heap_acquire() { while (atomic_xchg(&heap_lock, 1)) ; }
+static inline void heap_release() { atomic_xchg(&heap_lock, 0); }
+
 void* malloc(size_t size) {
-    /*#if !(defined(__ISA_NATIVE__) && defined(__NATIVE_USE_KLIB__))
-    panic("Not implemented");
-    #endif
-    return NULL;*/
-    static void* addr = NULL;
-    if (addr == NULL) addr = heap.start;
-    void* ret = addr;
-    addr += size;
+    heap_acquire();
+    void *ret = malloc_locked(size);
+    heap_release();
     return ret;
 }
 
-void free(void* ptr) {}
+void free(void* ptr) {
+    if (!ptr) return;
+    heap_acquire();
+    free_locked(ptr);
+    heap_release();
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > (size_t)-1 / size) return NULL;
+    void *ret = malloc(nmemb * size);
+    if (ret) memset(ret, 0, nmemb * size);
+    return ret;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ptr) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (size > (size_t)(heap_hi - heap_lo)) return NULL;  // blk_size() 会溢出
+    fblock_t *b = (fblock_t *)((char *)ptr - HDR);
+    size_t sz = blk_size(size);
+    heap_acquire();
+    size_t bsz = SIZE(b);
+    fblock_t *nb = NEXTBLK(b);
+    if (bsz < sz && !(nb->hdr & USED) && bsz + SIZE(nb) >= sz) { // 就地向后扩展
+        bin_remove(nb);
+        bsz += SIZE(nb);
+        set_blk(b, bsz, USED);
+    }
+    if (bsz >= sz) {
+        if (bsz - sz >= MINBLK) { // 多出的部分还给空闲链表
+            set_blk(b, sz, USED);
+            fblock_t *rest = NEXTBLK(b);
+            set_blk(rest, bsz - sz, USED);
+            free_locked((char *)rest + HDR);
+        }
+        if ((char *)NEXTBLK(b) > heap_peak) heap_peak = (char *)NEXTBLK(b);
+        heap_release();
+        return ptr;
+    }
+    heap_release();
+    void *ret = malloc(size);
+    if (ret) {
+        memcpy(ret, ptr, bsz - 2 * HDR);
+        free(ptr);
+    }
+    return ret;
+}
+
+// 曾经用到的最高地址与堆底的距离
+size_t malloc_footprint() {
+    return heap_ready ? heap_peak - heap_lo : 0;
+}
 
 #endif
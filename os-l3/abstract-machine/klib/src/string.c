@@ -4,10 +4,95 @@
 
 #if !defined(__ISA_NATIVE__) || defined(__NATIVE_USE_KLIB__)
 
-size_t strlen(const char *s) {
-    size_t len = 0;
-    while (s[len] != '\0') ++len;
-    return len;
+// 按机器字处理: x86 允许非对齐访问, 这里只对齐写入的一侧.
+// -mno-sse 下不能使用 SSE 寄存器, 大块拷贝/填充改用 ERMS 的 rep movsb/stosb.
+typedef unsigned long word_t;
+typedef word_t aword_t __attribute__((may_alias));               // 对齐的按字访问
+typedef word_t uword_t __attribute__((aligned(1), may_alias));   // 非对齐的按字访问
+#define WSIZE      sizeof(word_t)
+#define ONES       ((word_t)-1 / 0xff)  // 0x0101...01
+#define HIGHS      (ONES << 7)          // 0x8080...80
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+#define REP_MIN    512                  // rep 指令启动开销较大, 只用于大块
+#define NT_MIN     (256 << 10)          // 更大的块写完不会很快再用, 绕过 cache
+
+#if defined(__x86_64__) || defined(__i386__)
+static int erms = -1;
+
+static int has_erms() {
+    if (erms < 0) {
+        uint32_t a = 7, b, c = 0, d;
+        asm volatile ("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+        erms = (b >> 9) & 1;
+    }
+    return erms;
+}
+#endif
+
+// 关掉循环到 memcpy/memset 调用的识别, 否则会递归调用自身
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+// 非临时 (non-temporal) 写: movnti 只用通用寄存器, 不受 -mno-sse 限制.
+// 目的地址按字对齐, n 是 8 个字的整数倍; 最后用 sfence 保证写入对其他 CPU 可见.
+#if defined(__x86_64__) || defined(__i386__)
+#define NT_STORE(p, v) asm volatile ("movnti %1, %0" : "=m"(*(p)) : "r"(v))
+
+static void nt_copy(aword_t *d, const aword_t *s, size_t n) {
+    for (; n > 0; n -= 8, d += 8, s += 8) {
+        word_t a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];
+        word_t a4 = s[4], a5 = s[5], a6 = s[6], a7 = s[7];
+        NT_STORE(&d[0], a0); NT_STORE(&d[1], a1); NT_STORE(&d[2], a2); NT_STORE(&d[3], a3);
+        NT_STORE(&d[4], a4); NT_STORE(&d[5], a5); NT_STORE(&d[6], a6); NT_STORE(&d[7], a7);
+    }
+    asm volatile ("sfence" : : : "memory");
+}
+
+static void nt_fill(aword_t *d, word_t v, size_t n) {
+    for (; n > 0; n -= 8, d += 8) {
+        NT_STORE(&d[0], v); NT_STORE(&d[1], v); NT_STORE(&d[2], v); NT_STORE(&d[3], v);
+        NT_STORE(&d[4], v); NT_STORE(&d[5], v); NT_STORE(&d[6], v); NT_STORE(&d[7], v);
+    }
+    asm volatile ("sfence" : : : "memory");
+}
+#define HAS_NT 1
+#else
+#define HAS_NT 0
+#endif
+
+static NO_LIBCALL void copy_fwd(unsigned char *d, const unsigned char *s, size_t n);
+
+// 整页拷贝/清零: 目的页面通常不会马上被读到, 不要让它把 cache 里的数据挤出去.
+// dst (和 src) 至少按字对齐, size 是 64 字节的整数倍 (4 KiB 或 2 MiB 的页面).
+void copy_page(void *dst, const void *src, size_t size) {
+#if HAS_NT
+    if ((uintptr_t)dst % WSIZE == 0 && size % (8 * WSIZE) == 0) {
+        nt_copy(dst, src, size / WSIZE);
+        return;
+    }
+#endif
+    copy_fwd(dst, src, size);
+}
+
+void zero_page(void *dst, size_t size) {
+#if HAS_NT
+    if ((uintptr_t)dst % WSIZE == 0 && size % (8 * WSIZE) == 0) {
+        nt_fill(dst, 0, size / WSIZE);
+        return;
+    }
+#endif
+    memset(dst, 0, size);
+}
+
+NO_LIBCALL size_t strlen(const char *s) {
+    const char *p = s;
+    for (; (uintptr_t)p % WSIZE; p++)
+        if (*p == '\0') return p - s;
+    // 对齐的字读不会跨页, 即使越过了字符串末尾
+    const aword_t *w = (const aword_t *)p;
+    while (!HASZERO(*w)) w++;
+    for (p = (const char *)w; *p; p++)
+        ;
+    return p - s;
 }
 
 char *strcpy(char *s1, const char *s2) {
@@ -38,12 +123,22 @@ char *strcat(char *dst, const char *src) {
     return (dst);
 }
 
-int strcmp(const char *s1, const char *s2) {
+NO_LIBCALL int strcmp(const char *s1, const char *s2) {
+    if ((uintptr_t)s1 % WSIZE == (uintptr_t)s2 % WSIZE) {
+        for (; (uintptr_t)s1 % WSIZE; s1++, s2++) {
+            if (*s1 != *s2) goto diff;
+            if (*s1 == '\0') return 0;
+        }
+        const aword_t *w1 = (const aword_t *)s1, *w2 = (const aword_t *)s2;
+        for (; *w1 == *w2 && !HASZERO(*w1); w1++, w2++)
+            ;
+        s1 = (const char *)w1, s2 = (const char *)w2;
+    }
     for (; *s1 == *s2; s1++, s2++) {
         if (*s1 == '\0') return 0;
     }
-
-    return *s1 - *s2;
+diff:
+    return *(const unsigned char *)s1 - *(const unsigned char *)s2;
 }
 
 int strncmp(const char *s1, const char *s2, size_t n) {
@@ -58,41 +153,125 @@ int strncmp(const char *s1, const char *s2, size_t n) {
     return (*s1 - *s2);
 }
 
-void *memset(void *s, int c, size_t n) {
+NO_LIBCALL void *memset(void *s, int c, size_t n) {
+    unsigned char *d = s;
     const unsigned char uc = c;  // unsigned char 占一个字节，意味着只截取 c 的后八位
-    unsigned char *su;
-    for (su = s; 0 < n; ++su, --n) *su = uc;
+#if HAS_NT
+    if (n >= NT_MIN) {
+        size_t head = -(uintptr_t)d % WSIZE, body = (n - head) & ~(8 * WSIZE - 1);
+        for (; head > 0; head--, n--) *d++ = uc;
+        nt_fill((aword_t *)d, ONES * uc, body / WSIZE);
+        d += body, n -= body;
+        for (; 0 < n; ++d, --n) *d = uc;
+        return s;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= REP_MIN && has_erms()) {
+        asm volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(uc) : "memory");
+        return s;
+    }
+#endif
+    if (n >= WSIZE) {
+        word_t v = ONES * uc;
+        *(uword_t *)d = v;               // 非对齐的头部
+        size_t head = WSIZE - (uintptr_t)d % WSIZE;
+        d += head, n -= head;
+        for (; n >= 4 * WSIZE; n -= 4 * WSIZE, d += 4 * WSIZE) {
+            aword_t *w = (aword_t *)d;
+            w[0] = v; w[1] = v; w[2] = v; w[3] = v;
+        }
+        for (; n >= WSIZE; n -= WSIZE, d += WSIZE) *(aword_t *)d = v;
+    }
+    for (; 0 < n; ++d, --n) *d = uc;
     return s;
 }
 
-void *memmove(void *dst, const void *src, size_t n) {
-    char *src1;
-    const char *src2;
+// 正向拷贝, 允许 dst < src 的重叠
+static NO_LIBCALL void copy_fwd(unsigned char *d, const unsigned char *s, size_t n) {
+#if HAS_NT
+    // 不重叠的大块拷贝
+    if (n >= NT_MIN && (d + n <= s || s + n <= d)) {
+        size_t head = -(uintptr_t)d % WSIZE, body = (n - head) & ~(8 * WSIZE - 1);
+        for (; head > 0; head--, n--) *d++ = *s++;
+        nt_copy((aword_t *)d, (const aword_t *)s, body / WSIZE);
+        d += body, s += body, n -= body;
+        for (; 0 < n; --n) *d++ = *s++;
+        return;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= REP_MIN && has_erms()) {
+        asm volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+        return;
+    }
+#endif
+    // 两者相距不足一个字时, 写入会覆盖还没读的数据, 这种情况逐字节拷贝
+    if (n >= WSIZE && (d + WSIZE <= s || s + WSIZE <= d)) {
+        // 先对齐目的地址, 头部这个非对齐的字可能与后面重叠写入, 内容相同
+        size_t head = WSIZE - (uintptr_t)d % WSIZE;
+        *(uword_t *)d = *(const uword_t *)s;
+        d += head, s += head, n -= head;
+        for (; n >= 4 * WSIZE; n -= 4 * WSIZE, d += 4 * WSIZE, s += 4 * WSIZE) {
+            const uword_t *sw = (const uword_t *)s;
+            word_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+            aword_t *dw = (aword_t *)d;
+            dw[0] = a; dw[1] = b; dw[2] = c; dw[3] = e;
+        }
+        for (; n >= WSIZE; n -= WSIZE, d += WSIZE, s += WSIZE)
+            *(aword_t *)d = *(const uword_t *)s;
+    }
+    for (; 0 < n; --n) *d++ = *s++;
+}
 
-    src1 = dst;
-    src2 = src;
-    if (src2 < src1 && src1 < src2 + n)
-        for (src1 += n, src2 += n; 0 < n; --n) *--src1 = *--src2;
-    else
-        for (; 0 < n; --n) *src1++ = *src2++;
+// 反向拷贝, 用于 src < dst < src + n 的重叠
+static NO_LIBCALL void copy_bwd(unsigned char *d, const unsigned char *s, size_t n) {
+    d += n, s += n;
+    if (d >= s + WSIZE) {
+        for (; n > 0 && (uintptr_t)d % WSIZE; --n) *--d = *--s;
+        for (; n >= WSIZE; n -= WSIZE) {
+            d -= WSIZE, s -= WSIZE;
+            *(aword_t *)d = *(const uword_t *)s;
+        }
+    }
+    for (; 0 < n; --n) *--d = *--s;
+}
 
-    return (dst);
+void *memmove(void *dst, const void *src, size_t n) {
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+    if (s < d && d < s + n)
+        copy_bwd(d, s, n);
+    else
+        copy_fwd(d, s, n);
+    return dst;
 }
 
 void *memcpy(void *out, const void *in, size_t n) {
-    char *out_u;
-    const char *in_u;
-    for (out_u = out, in_u = in; 0 < n; ++out_u, ++in_u, --n) *out_u = *in_u;
-
+    copy_fwd(out, in, n);
     return out;
 }
 
-int memcmp(const void *s1, const void *s2, size_t n) {
-    const unsigned char *su1, *su2;
-    for (su1 = s1, su2 = s2; 0 < n; ++su1, ++su2, --n)
+NO_LIBCALL int memcmp(const void *s1, const void *s2, size_t n) {
+    const unsigned char *su1 = s1, *su2 = s2;
+    for (; n >= WSIZE && *(const uword_t *)su1 == *(const uword_t *)su2;
+         n -= WSIZE, su1 += WSIZE, su2 += WSIZE)
+        ;
+    for (; 0 < n; ++su1, ++su2, --n)
         if (*su1 != *su2) return ((*su1 < *su2) ? -1 : +1);
 
     return (0);
 }
 
+#else
+
+// native 使用 glibc 的 mem* 时, 只提供整页操作的接口
+void copy_page(void *dst, const void *src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+void zero_page(void *dst, size_t size) {
+    memset(dst, 0, size);
+}
+
 #endif
@@ -41,9 +41,14 @@ MODULE(kmt) {
 };
 
 typedef struct device device_t;
+typedef struct devops devops_t;
 MODULE(dev) {
   void (*init)();
   device_t *(*lookup)(const char *name);
+  int (*create)(const char *name, int id, int size, devops_t *ops); // returns a handle
+  int (*handle)(const char *name); // -1 if not found
+  device_t *(*get)(int handle);
+  void (*stat)();
 };
 
 MODULE(uproc) {
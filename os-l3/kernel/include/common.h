@@ -19,6 +19,13 @@ typedef int lock_t;
 #define KB (1024)
 #define MB (1024 * KB)
 #define GB (1024 * MB)
+#define PGSIZE (4 * KB) // 用户地址空间的页面大小
+#define HUGE_PGSZ (2 * MB) // 大页面：pmm->alloc(HUGE_PGSZ) 返回 2 MiB 对齐的内存
+#ifdef __ARCH_X86_64_QEMU
+#define HAS_HUGEPG (1) // 只有 x86_64 的 vme 支持 MMAP_HUGE
+#else
+#define HAS_HUGEPG (0)
+#endif
 
 #define TASK_INIT(task) do { \
   task->valid = TAG;\
@@ -29,6 +36,8 @@ typedef int lock_t;
   task->ntrap = 0; \
   task->next = NULL;\
   task->dead = 0;\
+  task->wakeup = 0;\
+  task->pgdefer = NULL;\
   task->parent = NULL; task->chldlist = NULL;\
   task->presib = task->nxtsib = NULL;\
   task->xclist = NULL;\
@@ -65,8 +74,28 @@ typedef struct adrspc {
   void * pa[PG_NR]; // 属于该地址空间的物理地址
   int prot;   // 记录某一个进程对于某一个地址空间的权限，对于共享地址空间，该值一旦确定好之后就不再变化
   int share; // 该地址空间是否共享
+  int huge;  // 是否允许使用 2 MiB 的大页面映射（其中完整对齐的 2 MiB 区域使用大页面）
+  const uint8_t * file; // 文件映射：[area.start, area.start + filesz) 的内容来自 ELF 映像，其余部分为零
+  uintptr_t filesz;
 }adrspc_t;
 
+// 程序映像：解析一次 ELF，之后所有运行该程序的进程共享只读段
+#define SEG_NR (8)
+typedef struct image {
+  const char * name;
+  const uint8_t * elf;
+  uintptr_t entry; // 程序入口
+  void * end; // 最后一个段的结束地址（页对齐），之后是 mmap 的空闲空间
+  int segnr;
+  struct {
+    Area area;
+    int prot;
+    const uint8_t * file;
+    uintptr_t filesz;
+    adrspc_t * shared; // 只读段：所有进程共享的地址段，映像本身持有一个引用，永远不会被回收
+  } seg[SEG_NR];
+}image_t;
+
 struct task {
   int             valid; // for debugging, initialized as TAG.(0x55555555)
   const char      *name; // for debugging
@@ -76,6 +105,7 @@ struct task {
   struct task     *next; // used in semaphore
   int             dead; // either exit() or kill() will change the value to 1
   int             running; // 0: ok to be scheduled if stack is safe 1: should not be scheduled
+  uint64_t        wakeup; // sleep(): 在 uptime 到达之前不参与调度
   Context         *context[MAX_INTR]; // 考虑到嵌套的问题,上下文需要保存为一个数组
   int             ntrap; // trap嵌套层数 number of trap， Depth of os_trap() nesting
   AddrSpace       as;  // 地址空间，用户线程独有
@@ -99,6 +129,7 @@ struct task {
   void *          fraddr; // [fraddr, MAX)是mmap未分配区域
   int             adrnr;  // 地址段的个数：初始化为2，代码段和栈区
   adrspc_t        *adrlist[128]; // 当前的进程所拥有的地址空间的数组（空间碎片链表）   
+  void *          pgdefer; // 取消映射后等待 TLB shootdown 完成才能释放的页面（用页面本身串成链表）
 };
 
 
@@ -124,8 +155,11 @@ typedef struct item {
 task_t * current_proc(); // 主要是给uproc提供接口，current process
 void  addTask(task_t * task); // 添加任务
 task_t * getTask(int pid); // get task by id
+void sleep_until(uint64_t deadline); // 睡眠到 uptime (us) 到达 deadline
 void inc_pgcnt(void* pa); // increment page count
 void dec_pgcnt(void* pa); // decrease page cnt
+void pgdefer_release(task_t *task); // 释放 task->pgdefer 上的页面
+int pgzero_work(); // 空闲时清零已释放的页面，放入预清零页面池
 // ------------------ debug --------------------
 #ifdef LOCAL_MACHINE
   #define debug(...) printf(__VA_ARGS__)
@@ -1,15 +1,25 @@
-typedef struct devops {
+struct devops {
   int (*init)(device_t *dev);
   int (*read) (device_t *dev, int offset, void *buf, int count);
   int (*write)(device_t *dev, int offset, const void *buf, int count);
-} devops_t;
+};
 extern devops_t tty_ops, fb_ops, sd_ops, input_ops;
 
+struct dev_stat {
+  uint64_t nread, nwrite;     // calls
+  uint64_t rbytes, wbytes;    // returned by the driver
+  uint64_t rtime, wtime;      // cumulative latency (us)
+};
+
 struct device {
   const char *name;
   int id;
   void *ptr;
-  devops_t *ops;
+  devops_t *ops;       // counting wrappers around drv
+  devops_t *drv;
+  int handle;
+  device_t *hnext;     // hash chain
+  struct dev_stat stat;
 };
 
 // Input
@@ -20,11 +30,14 @@ struct input_event {
   uint32_t data: 16;
 };
 
+// events[] is a single-producer (input daemon) single-consumer (tty
+// daemon) ring: only the producer moves rear, only the consumer moves front
 typedef struct {
-  spinlock_t lock;
   sem_t event_sem;
   struct input_event *events;
-  int front, rear;
+  volatile uint32_t front, rear;
+  uint32_t dropped;        // events lost because the ring was full
+  uint64_t heartbeat;      // time of the last idle event
   int capslock, shift_down[2], ctrl_down[2], alt_down[2];
 } input_t;
 
@@ -67,6 +80,13 @@ typedef struct {
   struct display_info *info;
   struct texture *textures;
   struct sprite *sprites;
+  int nsprite;              // sprites[nsprite..] have never been written
+  uint32_t *back;           // the damaged rectangle being composed, packed
+  // sprites with a texture, bucketed by the texture row of their top edge;
+  // -1 terminated doubly linked lists of sprite indices
+  int nrow;
+  int16_t *row_head, *row_next, *row_prev;
+  struct { int x0, y0, x1, y1; } damage; // to be recomposed and pushed
 } fb_t;
 
 // -------------------------------------------------------------------
@@ -83,18 +103,79 @@ struct tty_queue {
 
 typedef struct {
   sem_t lock, cooked;
+  sem_t flush; int pending; // output waiting to be rendered by the flush task
   device_t *fbdev; int display;
   int lines, columns, size;
   struct character *buf, *end, *cursor;
   struct tty_queue queue;
-  uint8_t *dirty;
+  struct tty_span { int lo, hi; } *dirty; // dirty columns [lo, hi) of each line
+  int dirty_lo, dirty_hi;   // lines that have a non-empty span
+  int *width;               // columns of each line that may hold a character
   struct sprite *sp_buf;
 } tty_t;
 
 // -------------------------------------------------------------------
 // SCSI (Standard) Disk
 
+// Block buffer cache: buffers are looked up by block number, recycled in
+// LRU order and written back lazily by the sd flusher task.
+struct buf {
+  uint32_t blkno;
+  int valid, dirty, refcnt;
+  sem_t lock;               // sleep lock, held while the data is in use
+  uint8_t *data;
+  struct buf *prev, *next;  // LRU list, most recently used first
+};
+
+// A (multi-block) disk request, queued for the sd I/O task. The submitter
+// sleeps on @done until the transfer is complete.
+struct bio_req {
+  int write;
+  void *buf;
+  uint32_t blkno, blkcnt;
+  uint64_t time;            // submission time (us)
+  sem_t done;
+  struct bio_req *next;
+};
+
+// I/O scheduler statistics
+struct bio_stat {
+  uint64_t nreq, ncmd;      // requests completed, device commands issued
+  uint64_t lat_total, lat_max; // request latency (us), submission to completion
+  int depth, depth_max;     // requests in the queue
+  uint64_t depth_total;     // sum of the depths seen by new requests
+};
+
+// Readahead state of one reader (task): a read starting where its previous
+// one ended doubles the prefetch window, any other read resets it.
+#define NR_RA 8
+struct ra_state {
+  task_t *task;
+  uint32_t next;            // block after the reader's previous read
+  uint32_t end;             // prefetched (or queued) up to here
+  int window;
+};
+
 typedef struct {
   uint32_t blkcnt, blksz;
-  uint8_t *buf;
+  spinlock_t qlock;         // protects the request queue
+  struct bio_req *qhead;    // sorted by block number
+  uint32_t qpos;            // where the elevator is
+  sem_t qsem;               // requests in the queue
+  uint8_t *iobuf;           // staging area for merged requests
+  struct bio_stat stat;
+  spinlock_t lock;          // protects the LRU list and buffer metadata
+  struct buf head, *bufs;
+  int ndirty;
+  sem_t flush;              // wakes up the flusher
+  uint8_t *wbuf;            // the flusher's staging area for multi-block writes
+  uint8_t *rbuf;            // staging area for multi-block cache misses
+  sem_t rlock;              // held while rbuf is in use
+  uint64_t flush_time;
+  uint64_t hits, misses;    // buffer cache statistics
+  struct ra_state ra[NR_RA];
+  int ra_next;              // slot to recycle
+  struct { uint32_t blkno, blkcnt; } ra_jobs[NR_RA];
+  int ra_front, ra_rear;    // ring of prefetch jobs, protected by @lock
+  sem_t ra_sem;             // jobs for the readahead task
 } sd_t;
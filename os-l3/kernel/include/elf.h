@@ -0,0 +1,44 @@
+#ifndef __ELF_H
+#define __ELF_H
+
+#include <stdint.h>
+
+// 只包含装载静态链接的 64 位 ELF 可执行文件所需要的部分
+#define ELFMAG     "\177ELF"
+#define SELFMAG    4
+#define ELFCLASS64 2
+#define ET_EXEC    2
+#define PT_LOAD    1
+#define PF_X       0x1
+#define PF_W       0x2
+#define PF_R       0x4
+
+typedef struct {
+  unsigned char e_ident[16];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  uint64_t e_entry;
+  uint64_t e_phoff;
+  uint64_t e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+  uint32_t p_type;
+  uint32_t p_flags;
+  uint64_t p_offset;
+  uint64_t p_vaddr;
+  uint64_t p_paddr;
+  uint64_t p_filesz;
+  uint64_t p_memsz;
+  uint64_t p_align;
+} Elf64_Phdr;
+
+#endif
@@ -5,6 +5,7 @@
 #define CPU_NR 8
 #define SLAB_TYPE_NR 9
 #define PGSZ (8 KiB) // 页面的大小
+#define ZPGSZ (4 KiB) // 预清零页面池中的页面大小，与 AddrSpace 的 pgsize 一致
 #define ALIGN(_A,_B) (((_A+_B-1)/_B)*_B)
 
 typedef struct list{
@@ -8,43 +8,134 @@
   _(3, tty_t,   "tty2",     2, &tty_ops) \
   _(4, sd_t,    "sda",      1, &sd_ops) \
 
-#define DEV_CNT(...) + 1
-device_t *devices[0 DEVICES(DEV_CNT)];
+#define NDEV  64
+#define NHASH 64 // power of 2
+
+static device_t *devices[NDEV], *dev_hash[NHASH];
+static int ndev;
+static spinlock_t dev_lock; // serializes dev_create(); lookups take no lock
+
+static uint32_t dev_hashof(const char *name) { // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *name; name++) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h & (NHASH - 1);
+}
+
+static int dev_handle(const char *name) {
+  for (device_t *d = dev_hash[dev_hashof(name)]; d; d = d->hnext)
+    if (strcmp(d->name, name) == 0)
+      return d->handle;
+  return -1;
+}
+
+static device_t *dev_get(int handle) {
+  return (handle >= 0 && handle < ndev) ? devices[handle] : NULL;
+}
 
 static device_t *dev_lookup(const char *name) {
-  for (int i = 0; i < LENGTH(devices); i++) 
-    if (strcmp(devices[i]->name, name) == 0)
-      return devices[i];
-  panic("lookup device failed.");
-  return NULL;
+  device_t *d = dev_get(dev_handle(name));
+  panic_on(!d, "lookup device failed.");
+  return d;
+}
+
+// every device is called through these, so that its stat is kept
+static int dev_read(device_t *dev, int offset, void *buf, int count) {
+  uint64_t t0 = io_read(AM_TIMER_UPTIME).us;
+  int ret = dev->drv->read(dev, offset, buf, count);
+  __sync_fetch_and_add(&dev->stat.nread, 1);
+  if (ret > 0) __sync_fetch_and_add(&dev->stat.rbytes, ret);
+  __sync_fetch_and_add(&dev->stat.rtime, io_read(AM_TIMER_UPTIME).us - t0);
+  return ret;
 }
 
-static device_t *dev_create(int size, const char* name, int id, devops_t *ops) {
+static int dev_write(device_t *dev, int offset, const void *buf, int count) {
+  uint64_t t0 = io_read(AM_TIMER_UPTIME).us;
+  int ret = dev->drv->write(dev, offset, buf, count);
+  __sync_fetch_and_add(&dev->stat.nwrite, 1);
+  if (ret > 0) __sync_fetch_and_add(&dev->stat.wbytes, ret);
+  __sync_fetch_and_add(&dev->stat.wtime, io_read(AM_TIMER_UPTIME).us - t0);
+  return ret;
+}
+
+static int dev_ops_init(device_t *dev) {
+  return dev->drv->init(dev);
+}
+
+static devops_t counted_ops = {
+  .init  = dev_ops_init,
+  .read  = dev_read,
+  .write = dev_write,
+};
+
+// the driver is initialized before the device is published, so a
+// lock-free lookup never finds a device that is not ready
+static int dev_create(const char *name, int id, int size, devops_t *ops) {
   device_t *dev = pmm->alloc(sizeof(device_t));
   *dev = (device_t) {
     .name = name,
     .ptr  = pmm->alloc(size),
     .id   = id,
-    .ops  = ops,
+    .ops  = &counted_ops,
+    .drv  = ops,
   };
-  return dev;
+  ops->init(dev);
+
+  kmt->spin_lock(&dev_lock);
+  panic_on(dev_handle(name) >= 0, "device already exists.");
+  panic_on(ndev >= NDEV, "too many devices.");
+  int h = dev->handle = ndev;
+  devices[h] = dev;
+  __sync_synchronize(); // published only when complete
+  ndev = h + 1;
+  uint32_t b = dev_hashof(name);
+  dev->hnext = dev_hash[b];
+  __sync_synchronize();
+  dev_hash[b] = dev;
+  kmt->spin_unlock(&dev_lock);
+  return h;
+}
+
+static void dev_stat() {
+  for (int i = 0; i < ndev; i++) {
+    struct dev_stat *st = &devices[i]->stat;
+    printf("%s: read %d calls, %d bytes, %d ms; write %d calls, %d bytes, %d ms\n",
+      devices[i]->name,
+      (int)st->nread,  (int)st->rbytes, (int)(st->rtime / 1000),
+      (int)st->nwrite, (int)st->wbytes, (int)(st->wtime / 1000));
+  }
 }
 
 void dev_input_task();
 void dev_tty_task();
+void dev_tty_flush_task(void *arg);
+void dev_sd_task(void *arg);
+void dev_sd_io_task(void *arg);
+void dev_sd_ra_task(void *arg);
 
 static void dev_init() {
+  kmt->spin_init(&dev_lock, "device registry");
 #define INIT(id, device_type, dev_name, dev_id, dev_ops) \
-  devices[id] = dev_create(sizeof(device_type), dev_name, dev_id, dev_ops); \
-  devices[id]->ops->init(devices[id]);
+  dev_create(dev_name, dev_id, sizeof(device_type), dev_ops);
 
   DEVICES(INIT);
 
   kmt->create(pmm->alloc(sizeof(task_t)), "input-task", dev_input_task, NULL);
   kmt->create(pmm->alloc(sizeof(task_t)), "tty-task",   dev_tty_task,   NULL);
+  kmt->create(pmm->alloc(sizeof(task_t)), "tty1-flush", dev_tty_flush_task, dev_lookup("tty1"));
+  kmt->create(pmm->alloc(sizeof(task_t)), "tty2-flush", dev_tty_flush_task, dev_lookup("tty2"));
+  device_t *sd = dev_lookup("sda");
+  if (sd->ptr) {
+    kmt->create(pmm->alloc(sizeof(task_t)), "sd-flusher", dev_sd_task,    sd);
+    kmt->create(pmm->alloc(sizeof(task_t)), "sd-io",      dev_sd_io_task, sd);
+    kmt->create(pmm->alloc(sizeof(task_t)), "sd-ra",      dev_sd_ra_task, sd);
+  }
 }
 
 MODULE_DEF(dev) = {
   .init   = dev_init,
   .lookup = dev_lookup,
+  .create = dev_create,
+  .handle = dev_handle,
+  .get    = dev_get,
+  .stat   = dev_stat,
 };
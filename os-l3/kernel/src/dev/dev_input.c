@@ -1,8 +1,10 @@
 #include <os.h>
 #include <devices.h>
 
-#define NEVENTS 128
+#define NEVENTS   128 // power of 2
+#define HEARTBEAT 100000 // us
 static sem_t sem_kbdirq;
+static input_t *input;
 static char keymap[][2];
 
 static struct input_event event(int ctrl, int alt, int data) {
@@ -17,23 +19,28 @@ static int is_empty(input_t *in) {
   return in->rear == in->front;
 }
 
+// the slot is written before rear is published; a full ring drops the event
 static void push_event(input_t *in, struct input_event ev) {
-  kmt->spin_lock(&in->lock);
-  in->events[in->rear] = ev;
-  in->rear = (in->rear + 1) % NEVENTS;
-  panic_on(is_empty(in), "input queue full");
-  kmt->spin_unlock(&in->lock);
+  uint32_t rear = in->rear;
+  if (rear - in->front == NEVENTS) {
+    in->dropped++;
+    return;
+  }
+  in->events[rear % NEVENTS] = ev;
+  __sync_synchronize();
+  in->rear = rear + 1;
   kmt->sem_signal(&in->event_sem);
 }
 
+// the slot is read before front is published, so it cannot be overwritten
 static struct input_event pop_event(input_t *in) {
   kmt->sem_wait(&in->event_sem);
-  kmt->spin_lock(&in->lock);
-  panic_on(is_empty(in), "input queue empty");
-  int idx = in->front;
-  in->front = (in->front + 1) % NEVENTS;
-  struct input_event ret = in->events[idx];
-  kmt->spin_unlock(&in->lock);
+  uint32_t front = in->front;
+  panic_on(front == in->rear, "input queue empty");
+  __sync_synchronize();
+  struct input_event ret = in->events[front % NEVENTS];
+  __sync_synchronize();
+  in->front = front + 1;
   return ret;
 }
 
@@ -90,17 +97,29 @@ static Context *input_notify(Event ev, Context *context) {
   return NULL;
 }
 
+// the idle heartbeat is the only reason a timer wakes the input daemon
+static Context *input_tick(Event ev, Context *context) {
+  input_t *in = input;
+  if (in && is_empty(in) && sem_kbdirq.count <= 0 &&
+      io_read(AM_TIMER_UPTIME).us - in->heartbeat > HEARTBEAT) {
+    kmt->sem_signal(&sem_kbdirq);
+  }
+  return NULL;
+}
+
 static int input_init(device_t *dev) {
   input_t *in = dev->ptr;
   in->events = pmm->alloc(sizeof(in->events[0]) * NEVENTS);
   in->front = in->rear = 0;
+  in->dropped = 0;
+  in->heartbeat = io_read(AM_TIMER_UPTIME).us;
 
-  kmt->spin_init(&in->lock, "/dev/input lock");
   kmt->sem_init(&in->event_sem, "events in queue", 0);
   kmt->sem_init(&sem_kbdirq, "keyboard-interrupt", 0);
 
+  input = in;
   os->on_irq(0, EVENT_IRQ_IODEV, input_notify);
-  os->on_irq(0, EVENT_IRQ_TIMER, input_notify);
+  os->on_irq(0, EVENT_IRQ_TIMER, input_tick);
   return 0;
 }
 
@@ -181,20 +200,21 @@ static char keymap[256][2] = {
 // ------------------------------------------------------------------
 
 void dev_input_task(void *args) {
-  device_t *in = dev->lookup("input");
-  uint32_t known_time = io_read(AM_TIMER_UPTIME).us;
+  device_t *in = dev->get(dev->handle("input"));
+  panic_on(!in, "lookup device failed.");
+  input_t *inp = in->ptr;
 
   while (1) {
-    uint32_t time;
+    uint64_t time;
     AM_INPUT_KEYBRD_T key;
     while ((key = io_read(AM_INPUT_KEYBRD)).keycode != 0) {
       input_keydown(in, key);
     }
     time = io_read(AM_TIMER_UPTIME).us;
-    if ((time - known_time) / 1000 > 100 && is_empty(in->ptr)) {
-      push_event(in->ptr, event(0, 0, 0));
-      known_time = time;
+    if (time - inp->heartbeat > HEARTBEAT && is_empty(inp)) {
+      push_event(inp, event(0, 0, 0));
     }
+    if (!is_empty(inp)) inp->heartbeat = time; // no heartbeat while busy
     kmt->sem_wait(&sem_kbdirq);
   }
 }
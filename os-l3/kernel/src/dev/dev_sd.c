@@ -1,6 +1,233 @@
 #include <os.h>
 #include <devices.h>
 
+#define NBUF            64       // buffers in the cache
+#define FLUSH_DIRTY     (NBUF / 4) // wake up the flusher at this many dirty buffers
+#define FLUSH_INTERVAL  1000000  // or this long (us) after the last flush
+
+#define MAX_BATCH       16       // blocks in one coalesced device command
+#define MAX_MERGE       64       // blocks in one merged dispatch
+#define DEADLINE        50000    // (us) a request older than this is served first
+#define RA_MIN          4        // initial readahead window (blocks)
+#define RA_MAX          (NBUF / 2)
+
+static sd_t *sda; // for the timer handler
+
+static void lru_remove(struct buf *b) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void lru_push(sd_t *sd, struct buf *b) {
+  b->next = sd->head.next;
+  b->prev = &sd->head;
+  sd->head.next->prev = b;
+  sd->head.next = b;
+}
+
+// queue a transfer for the I/O task and sleep until it is done
+static void blk_io(sd_t *sd, int write, void *buf, uint32_t blkno, uint32_t blkcnt) {
+  struct bio_req req = {
+    .write = write, .buf = buf,
+    .blkno = blkno, .blkcnt = blkcnt,
+    .time  = io_read(AM_TIMER_UPTIME).us,
+  };
+  kmt->sem_init(&req.done, "sda request", 0);
+  kmt->spin_lock(&sd->qlock);
+  struct bio_req **pos = &sd->qhead;
+  while (*pos && (*pos)->blkno <= blkno) pos = &(*pos)->next;
+  req.next = *pos;
+  *pos = &req;
+  struct bio_stat *st = &sd->stat;
+  st->depth_total += st->depth++;
+  if (st->depth > st->depth_max) st->depth_max = st->depth;
+  kmt->spin_unlock(&sd->qlock);
+  kmt->sem_signal(&sd->qsem);
+  kmt->sem_wait(&req.done);
+}
+
+// write back every dirty buffer that nobody is using, in block order, with
+// contiguous blocks coalesced into one device command
+static void sd_flush(sd_t *sd) {
+  struct buf *dirty[NBUF];
+  int n = 0;
+  kmt->spin_lock(&sd->lock);
+  for (int i = 0; i < NBUF; i++) {
+    struct buf *b = &sd->bufs[i];
+    if (b->dirty && b->refcnt == 0) {
+      b->refcnt++;
+      int j = n++;
+      for (; j > 0 && dirty[j - 1]->blkno > b->blkno; j--) dirty[j] = dirty[j - 1];
+      dirty[j] = b;
+    }
+  }
+  kmt->spin_unlock(&sd->lock);
+
+  for (int i = 0; i < n; i++) kmt->sem_wait(&dirty[i]->lock);
+  for (int i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && j - i < MAX_BATCH && dirty[j]->blkno == dirty[j - 1]->blkno + 1; j++) ;
+    for (int k = i; k < j; k++) memcpy(sd->wbuf + (k - i) * sd->blksz, dirty[k]->data, sd->blksz);
+    blk_io(sd, true, sd->wbuf, dirty[i]->blkno, j - i);
+  }
+
+  kmt->spin_lock(&sd->lock);
+  for (int i = 0; i < n; i++) {
+    dirty[i]->dirty = 0;
+    dirty[i]->refcnt--;
+    sd->ndirty--;
+  }
+  kmt->spin_unlock(&sd->lock);
+  for (int i = 0; i < n; i++) kmt->sem_signal(&dirty[i]->lock);
+  sd->flush_time = io_read(AM_TIMER_UPTIME).us;
+}
+
+// return the locked buffer of @blkno; its data is valid only if b->valid
+static struct buf *bget(sd_t *sd, uint32_t blkno) {
+  while (1) {
+    kmt->spin_lock(&sd->lock);
+    struct buf *b;
+    for (b = sd->head.next; b != &sd->head; b = b->next) {
+      if (b->blkno == blkno && (b->valid || b->refcnt > 0)) {
+        b->refcnt++;
+        sd->hits++;
+        kmt->spin_unlock(&sd->lock);
+        kmt->sem_wait(&b->lock);
+        return b;
+      }
+    }
+    // recycle the least recently used clean buffer
+    for (b = sd->head.prev; b != &sd->head; b = b->prev) {
+      if (b->refcnt == 0 && !b->dirty) {
+        b->blkno  = blkno;
+        b->valid  = 0;
+        b->refcnt = 1;
+        sd->misses++;
+        kmt->spin_unlock(&sd->lock);
+        kmt->sem_wait(&b->lock); // free: nobody else holds a reference
+        return b;
+      }
+    }
+    kmt->spin_unlock(&sd->lock);
+    kmt->sem_signal(&sd->flush); // every buffer is dirty or in use
+    yield();
+  }
+}
+
+// number of blocks from @blkno on (at most @max) that are not cached
+static int uncached(sd_t *sd, uint32_t blkno, int max) {
+  int n = 1;
+  kmt->spin_lock(&sd->lock);
+  for (; n < max && blkno + n < sd->blkcnt; n++) {
+    struct buf *b;
+    for (b = sd->head.next; b != &sd->head; b = b->next) {
+      if (b->blkno == blkno + n && (b->valid || b->refcnt > 0)) break;
+    }
+    if (b != &sd->head) break;
+  }
+  kmt->spin_unlock(&sd->lock);
+  return n;
+}
+
+static void brelse(sd_t *sd, struct buf *b, int dirty);
+
+// like bget(), but only if that would not wait for another holder: the
+// buffer of @blkno must be unreferenced (or there is a clean one to
+// recycle); NULL otherwise
+static struct buf *bget_idle(sd_t *sd, uint32_t blkno) {
+  kmt->spin_lock(&sd->lock);
+  struct buf *b;
+  for (b = sd->head.next; b != &sd->head; b = b->next) {
+    if (b->blkno == blkno && (b->valid || b->refcnt > 0)) break;
+  }
+  if (b == &sd->head) {
+    for (b = sd->head.prev; b != &sd->head; b = b->prev) {
+      if (b->refcnt == 0 && !b->dirty) {
+        b->blkno = blkno;
+        b->valid = 0;
+        break;
+      }
+    }
+  }
+  if (b == &sd->head || b->refcnt > 0) {
+    kmt->spin_unlock(&sd->lock);
+    return NULL;
+  }
+  b->refcnt = 1;
+  kmt->spin_unlock(&sd->lock);
+  kmt->sem_wait(&b->lock); // unreferenced: the lock is free
+  return b;
+}
+
+// A miss reads the following uncached blocks of the request (up to @want)
+// with the same device command and puts them into the cache as well.
+// Their buffers are taken before the read is issued, so until they are
+// filled a reader of those blocks waits for them, and a write cannot
+// happen in between and be overwritten by the older disk data.
+// They go through sd->rbuf; a reader holding it only takes buffers that
+// nobody else holds, so it never waits for a reader waiting for rbuf.
+static struct buf *bread(sd_t *sd, uint32_t blkno, int want) {
+  struct buf *b = bget(sd, blkno);
+  if (b->valid) return b;
+
+  int n = uncached(sd, blkno, want < MAX_BATCH ? want : MAX_BATCH);
+  struct buf *nb[MAX_BATCH];
+  if (n > 1) {
+    kmt->sem_wait(&sd->rlock);
+    for (int i = 1; i < n; i++) {
+      nb[i] = bget_idle(sd, blkno + i);
+      if (nb[i] && !nb[i]->valid) continue;
+      if (nb[i]) brelse(sd, nb[i], 0); // cached meanwhile
+      n = i; // the run stops here
+      break;
+    }
+    if (n == 1) kmt->sem_signal(&sd->rlock);
+  }
+  if (n == 1) {
+    blk_io(sd, false, b->data, blkno, 1);
+    b->valid = 1;
+    return b;
+  }
+  blk_io(sd, false, sd->rbuf, blkno, n);
+  memcpy(b->data, sd->rbuf, sd->blksz);
+  b->valid = 1;
+  for (int i = 1; i < n; i++) {
+    memcpy(nb[i]->data, sd->rbuf + i * sd->blksz, sd->blksz);
+    nb[i]->valid = 1;
+    brelse(sd, nb[i], 0);
+  }
+  kmt->sem_signal(&sd->rlock);
+  return b;
+}
+
+static void brelse(sd_t *sd, struct buf *b, int dirty) {
+  kmt->spin_lock(&sd->lock);
+  if (dirty && !b->dirty) {
+    b->dirty = 1;
+    sd->ndirty++;
+  }
+  int wakeup = dirty && sd->ndirty == FLUSH_DIRTY;
+  kmt->spin_unlock(&sd->lock);
+  kmt->sem_signal(&b->lock);
+
+  kmt->spin_lock(&sd->lock);
+  if (--b->refcnt == 0) {
+    lru_remove(b);
+    lru_push(sd, b);
+  }
+  kmt->spin_unlock(&sd->lock);
+  if (wakeup) kmt->sem_signal(&sd->flush);
+}
+
+static Context *sd_tick(Event ev, Context *context) {
+  sd_t *sd = sda;
+  if (sd && sd->ndirty > 0 && sd->flush.count <= 0 &&
+      io_read(AM_TIMER_UPTIME).us - sd->flush_time > FLUSH_INTERVAL) {
+    sd->flush_time = io_read(AM_TIMER_UPTIME).us;
+    kmt->sem_signal(&sd->flush);
+  }
+  return NULL;
+}
+
 static int sd_init(device_t *dev) {
   sd_t *sd = dev->ptr;
   if (!io_read(AM_DISK_CONFIG).present) {
@@ -8,30 +235,89 @@ static int sd_init(device_t *dev) {
   } else {
     sd->blkcnt = io_read(AM_DISK_CONFIG).blkcnt;
     sd->blksz  = io_read(AM_DISK_CONFIG).blksz;
-    sd->buf    = pmm->alloc(sd->blksz);
+    kmt->spin_init(&sd->lock, "/dev/sda cache");
+    kmt->sem_init(&sd->flush, "sda dirty buffers", 0);
+    sd->head.prev = sd->head.next = &sd->head;
+    sd->bufs = pmm->alloc(sizeof(struct buf) * NBUF);
+    for (int i = 0; i < NBUF; i++) {
+      struct buf *b = &sd->bufs[i];
+      b->data  = pmm->alloc(sd->blksz);
+      b->valid = b->dirty = b->refcnt = 0;
+      kmt->sem_init(&b->lock, "sda buffer", 1);
+      lru_push(sd, b);
+    }
+    sd->ndirty = 0;
+    sd->wbuf = pmm->alloc(MAX_BATCH * sd->blksz);
+    kmt->spin_init(&sd->qlock, "/dev/sda queue");
+    kmt->sem_init(&sd->qsem, "sda requests", 0);
+    sd->qhead = NULL;
+    sd->qpos = 0;
+    sd->iobuf = pmm->alloc(MAX_MERGE * sd->blksz);
+    sd->rbuf = pmm->alloc(MAX_MERGE * sd->blksz);
+    kmt->sem_init(&sd->rlock, "sda read staging", 1);
+    memset(&sd->stat, 0, sizeof(sd->stat));
+    sd->hits = sd->misses = 0;
+    memset(sd->ra, 0, sizeof(sd->ra));
+    sd->ra_next = sd->ra_front = sd->ra_rear = 0;
+    kmt->sem_init(&sd->ra_sem, "sda readahead", 0);
+    sd->flush_time = io_read(AM_TIMER_UPTIME).us;
+    sda = sd;
+    os->on_irq(0, EVENT_IRQ_TIMER, sd_tick);
   }
   return 0;
 }
 
-static void blk_read(void *buf, int blkno, int blkcnt) {
-  io_write(AM_DISK_BLKIO, false, buf, blkno, blkcnt);
-  while (!io_read(AM_DISK_STATUS).ready) ;
-}
+// Track the reader of [first, last] and, for a sequential stream, queue the
+// prefetch of the next window once less than half of it is left ahead.
+static void readahead(sd_t *sd, uint32_t first, uint32_t last) {
+  task_t *task = current_proc();
+  kmt->spin_lock(&sd->lock);
+  struct ra_state *ra = NULL;
+  for (int i = 0; i < NR_RA; i++) {
+    if (sd->ra[i].task == task) ra = &sd->ra[i];
+  }
+  if (!ra) {
+    ra = &sd->ra[sd->ra_next];
+    sd->ra_next = (sd->ra_next + 1) % NR_RA;
+    *ra = (struct ra_state) { .task = task, .next = -1 };
+  }
 
-static void blk_write(void *buf, int blkno, int blkcnt) {
-  io_write(AM_DISK_BLKIO, true, buf, blkno, blkcnt);
-  while (!io_read(AM_DISK_STATUS).ready) ;
+  if (first == ra->next || first + 1 == ra->next) { // the same block may be read again
+    ra->window = ra->window ? ra->window * 2 : RA_MIN;
+    if (ra->window > RA_MAX) ra->window = RA_MAX;
+  } else {
+    ra->window = 0;
+    ra->end = 0;
+  }
+  ra->next = last + 1;
+
+  uint32_t from = ra->end > ra->next ? ra->end : ra->next;
+  uint32_t to = ra->next + ra->window;
+  if (to > sd->blkcnt) to = sd->blkcnt;
+  int full = (sd->ra_rear + 1) % NR_RA == sd->ra_front;
+  int wakeup = ra->window && to > from && from - ra->next < ra->window / 2 && !full;
+  if (wakeup) {
+    sd->ra_jobs[sd->ra_rear].blkno  = from;
+    sd->ra_jobs[sd->ra_rear].blkcnt = to - from;
+    sd->ra_rear = (sd->ra_rear + 1) % NR_RA;
+    ra->end = to;
+  }
+  kmt->spin_unlock(&sd->lock);
+  if (wakeup) kmt->sem_signal(&sd->ra_sem);
 }
 
 static int sd_read(device_t *dev, int offset, void *buf, int count) {
   sd_t *sd = dev->ptr;
   panic_on(!sd, "no disk");
+  if (count <= 0) return 0;
+  readahead(sd, offset / sd->blksz, (offset + count - 1) / sd->blksz);
   uint32_t pos = 0;
   for (uint32_t st = ROUNDDOWN(offset, sd->blksz); pos < count; st = offset) {
     uint32_t n = sd->blksz - (offset - st);
     if (n > count - pos) n = count - pos;
-    blk_read(sd->buf, st / sd->blksz, 1);
-    memcpy((char *)buf + pos, sd->buf + offset - st, n);
+    struct buf *b = bread(sd, st / sd->blksz, (count - pos + offset - st + sd->blksz - 1) / sd->blksz);
+    memcpy((char *)buf + pos, b->data + offset - st, n);
+    brelse(sd, b, 0);
     pos   += n;
     offset = st + sd->blksz;
   }
@@ -45,17 +331,114 @@ static int sd_write(device_t *dev, int offset, const void *buf, int count) {
   for (uint32_t st = ROUNDDOWN(offset, sd->blksz); pos < count; st = offset) {
     uint32_t n = sd->blksz - (offset - st);
     if (n > count - pos) n = count - pos;
-    if (n < sd->blksz) {
-      blk_read(sd->buf, st / sd->blksz, 1);
-    }
-    memcpy(sd->buf + offset - st, (char *)buf + pos, n);
-    blk_write(sd->buf, st / sd->blksz, 1);
+    // a partial write needs the old content, a full one overwrites it
+    struct buf *b = (n < sd->blksz) ? bread(sd, st / sd->blksz, 1) : bget(sd, st / sd->blksz);
+    memcpy(b->data + offset - st, (char *)buf + pos, n);
+    b->valid = 1;
+    brelse(sd, b, 1);
     pos   += n;
     offset = st + sd->blksz;
   }
   return pos;
 }
 
+// C-SCAN elevator: the first request at or after the current position,
+// wrapping around to the lowest block; an expired request goes first.
+static struct bio_req **pick(sd_t *sd, uint64_t now) {
+  struct bio_req **first = NULL, **oldest = &sd->qhead;
+  for (struct bio_req **r = &sd->qhead; *r; r = &(*r)->next) {
+    if (!first && (*r)->blkno >= sd->qpos) first = r;
+    if ((*r)->time < (*oldest)->time) oldest = r;
+  }
+  if (now - (*oldest)->time > DEADLINE) return oldest;
+  return first ? first : &sd->qhead;
+}
+
+// issue the queued requests to the device; the submitters sleep meanwhile
+void dev_sd_io_task(void *arg) {
+  device_t *dev = arg;
+  sd_t *sd = dev->ptr;
+  struct bio_req *batch[MAX_MERGE];
+  while (1) {
+    kmt->sem_wait(&sd->qsem);
+    uint64_t now = io_read(AM_TIMER_UPTIME).us;
+
+    // take the picked request and the queued ones that continue it
+    kmt->spin_lock(&sd->qlock);
+    struct bio_req **pos = pick(sd, now);
+    int n = 0;
+    uint32_t blkno = (*pos)->blkno, blkcnt = 0, write = (*pos)->write;
+    while (*pos && (n == 0 || (n < MAX_MERGE && (*pos)->write == write &&
+           (*pos)->blkno == blkno + blkcnt && blkcnt + (*pos)->blkcnt <= MAX_MERGE))) {
+      batch[n++] = *pos;
+      blkcnt += (*pos)->blkcnt;
+      *pos = (*pos)->next;
+    }
+    sd->stat.depth -= n;
+    sd->qpos = blkno + blkcnt;
+    kmt->spin_unlock(&sd->qlock);
+    for (int i = 1; i < n; i++) kmt->sem_wait(&sd->qsem); // already signaled
+
+    void *buf = batch[0]->buf;
+    if (n > 1) {
+      buf = sd->iobuf;
+      for (int i = 0, off = 0; write && i < n; off += batch[i++]->blkcnt) {
+        memcpy(sd->iobuf + off * sd->blksz, batch[i]->buf, batch[i]->blkcnt * sd->blksz);
+      }
+    }
+    io_write(AM_DISK_BLKIO, write, buf, blkno, blkcnt);
+    while (!io_read(AM_DISK_STATUS).ready) yield();
+    if (n > 1) {
+      for (int i = 0, off = 0; !write && i < n; off += batch[i++]->blkcnt) {
+        memcpy(batch[i]->buf, sd->iobuf + off * sd->blksz, batch[i]->blkcnt * sd->blksz);
+      }
+    }
+
+    now = io_read(AM_TIMER_UPTIME).us;
+    struct bio_stat *st = &sd->stat;
+    st->ncmd++;
+    for (int i = 0; i < n; i++) {
+      uint64_t lat = now - batch[i]->time;
+      st->nreq++;
+      st->lat_total += lat;
+      if (lat > st->lat_max) st->lat_max = lat;
+      kmt->sem_signal(&batch[i]->done);
+    }
+  }
+}
+
+// read the queued prefetch windows into the cache
+void dev_sd_ra_task(void *arg) {
+  device_t *dev = arg;
+  sd_t *sd = dev->ptr;
+  while (1) {
+    kmt->sem_wait(&sd->ra_sem);
+    kmt->spin_lock(&sd->lock);
+    uint32_t blkno = sd->ra_jobs[sd->ra_front].blkno, end = blkno + sd->ra_jobs[sd->ra_front].blkcnt;
+    sd->ra_front = (sd->ra_front + 1) % NR_RA;
+    kmt->spin_unlock(&sd->lock);
+
+    for (; blkno < end; blkno++) {
+      brelse(sd, bread(sd, blkno, end - blkno), 0);
+    }
+  }
+}
+
+// background write-back of dirty buffers
+void dev_sd_task(void *arg) {
+  device_t *dev = arg;
+  sd_t *sd = dev->ptr;
+  while (1) {
+    kmt->sem_wait(&sd->flush);
+    sd_flush(sd);
+    Log("sda cache: %d hits, %d misses", (int)sd->hits, (int)sd->misses);
+    Log("sda queue: %d requests in %d commands, latency avg %d us max %d us, depth avg %d max %d",
+        (int)sd->stat.nreq, (int)sd->stat.ncmd,
+        (int)(sd->stat.nreq ? sd->stat.lat_total / sd->stat.nreq : 0), (int)sd->stat.lat_max,
+        (int)(sd->stat.nreq ? sd->stat.depth_total / sd->stat.nreq : 0), sd->stat.depth_max);
+  }
+}
+
 devops_t sd_ops = {
   .init  = sd_init,
   .read  = sd_read,
@@ -2,6 +2,7 @@
 #include <devices.h>
 
 #define TTY_COOK_BUF_SZ 1024
+#define TTY_FRAME_US    16667 // render at most 60 times per second
 
 static struct character tty_defaultch() {
   return (struct character) { .metadata = 0, .ch = '\0' };
@@ -33,14 +34,23 @@ static int tty_pop_back(struct tty_queue *q) {
   return 1;
 }
 
+static void tty_mark_span(tty_t *tty, int y, int lo, int hi);
+
 static void tty_upd_scrollup(tty_t *tty) {
    int move_sz = tty->columns * (tty->lines - 1);
    memmove(tty->buf, tty->buf + tty->columns, move_sz * sizeof(tty->buf[0]));
-   memmove(tty->dirty, tty->dirty + tty->columns, move_sz * sizeof(tty->dirty[0]));
    tty->cursor -= tty->columns;
    for (int i = 0; i < tty->columns; i++) {
      tty->cursor[i] = tty_defaultch();
    }
+   // a line changes only where either its old or its new content reaches,
+   // plus one cell for the cursor, which never goes past the content
+   for (int y = 0; y < tty->lines; y++) {
+     int w = (y + 1 < tty->lines) ? tty->width[y + 1] : 0;
+     int hi = (w > tty->width[y] ? w : tty->width[y]) + 1;
+     tty_mark_span(tty, y, 0, hi < tty->columns ? hi : tty->columns);
+     tty->width[y] = w;
+   }
 }
 
 static inline void tty_upd_cr(tty_t *tty) {
@@ -60,6 +70,8 @@ static inline void tty_upd_backsp(tty_t *tty) {
 }
 
 static inline void tty_upd_putc(tty_t *tty, char ch) {
+  int pos = tty->cursor - tty->buf, y = pos / tty->columns, x = pos % tty->columns;
+  if (x + 1 > tty->width[y]) tty->width[y] = x + 1;
   tty->cursor->ch = ch;
   tty->cursor++;
 }
@@ -87,45 +99,58 @@ static int tty_cook(tty_t *tty, char ch) {
 // tty marking
 // ------------------------------------------------------------------
 
+// Only the dirty spans are visited, and only they are cleared. The sprites
+// of cell i are kept at #(base + 2i) and #(base + 2i + 1) of the fb, so
+// each span is one write of the sprites that replace the old ones.
 static void tty_render(tty_t *tty) {
-  struct character *ch = tty->buf;
-  uint8_t *d = tty->dirty;
-  struct sprite *sp = tty->sp_buf;
   kmt->sem_wait(&tty->lock);
-  for (int y = 0; y < tty->lines; y++) {
-    for (int x = 0; x < tty->columns; x++) {
-      if (*d) {
-        int draw = (ch == tty->cursor && show_cursor) ? 0xdb : ch->ch;
-        *sp ++ = (struct sprite)
-        { .x = x * 8, .y = y * 16, .z = 0,
-          .display = tty->display, .texture = draw * 2 + 1 };
-        *sp ++ = (struct sprite)
-        { .x = x * 8, .y = y * 16 + 8, .z = 0,
-          .display = tty->display, .texture = draw * 2 + 2 };
-      }
-      ch++; d++;
+  for (int y = tty->dirty_lo; y < tty->dirty_hi; y++) {
+    struct tty_span *d = &tty->dirty[y];
+    struct sprite *sp = tty->sp_buf;
+    for (int x = d->lo; x < d->hi; x++) {
+      struct character *ch = &tty->buf[y * tty->columns + x];
+      int draw = (ch == tty->cursor && show_cursor) ? 0xdb : ch->ch;
+      *sp ++ = (struct sprite)
+      { .x = x * 8, .y = y * 16, .z = 0,
+        .display = tty->display, .texture = draw * 2 + 1 };
+      *sp ++ = (struct sprite)
+      { .x = x * 8, .y = y * 16 + 8, .z = 0,
+        .display = tty->display, .texture = draw * 2 + 2 };
+    }
+    int nsp = sp - tty->sp_buf;
+    if (nsp > 0) {
+      int first = tty->display * tty->size * 2 + (y * tty->columns + d->lo) * 2;
+      tty->fbdev->ops->write(tty->fbdev, SPRITE_BRK + first * sizeof(*sp), tty->sp_buf, nsp * sizeof(*sp));
     }
+    d->lo = tty->columns; d->hi = 0;
   }
-  int nsp = sp - tty->sp_buf;
-  tty->fbdev->ops->write(tty->fbdev, SPRITE_BRK, tty->sp_buf, nsp * sizeof(*sp));
-  // clear dirty marks
-  memset(tty->dirty, 0, tty->size * sizeof(tty->dirty[0]));
+  tty->dirty_lo = tty->lines; tty->dirty_hi = 0;
   kmt->sem_signal(&tty->lock);
 }
 
+static void tty_mark_span(tty_t *tty, int y, int lo, int hi) {
+  if (lo >= hi) return;
+  struct tty_span *d = &tty->dirty[y];
+  if (lo < d->lo) d->lo = lo;
+  if (hi > d->hi) d->hi = hi;
+  if (y < tty->dirty_lo) tty->dirty_lo = y;
+  if (y + 1 > tty->dirty_hi) tty->dirty_hi = y + 1;
+}
+
 static void tty_mark(tty_t *tty, struct character *ch) {
-  tty->dirty[ch - tty->buf] = 1;
+  int pos = ch - tty->buf;
+  if (pos < 0 || pos >= tty->size) return;
+  tty_mark_span(tty, pos / tty->columns, pos % tty->columns, pos % tty->columns + 1);
 }
 
 static void tty_mark_line(tty_t *tty, struct character *ch) {
-  int x = (ch - tty->buf) % tty->columns;
-  for (int i = 0; i < tty->columns; i++)
-    tty_mark(tty, ch - x + i);
+  int y = (ch - tty->buf) / tty->columns;
+  if (y < tty->lines) tty_mark_span(tty, y, 0, tty->columns);
 }
 
 static void tty_mark_all(tty_t *tty) {
-   for (int i = 0; i < tty->size; i++) {
-     tty_mark(tty, &tty->buf[i]);
+   for (int y = 0; y < tty->lines; y++) {
+     tty_mark_span(tty, y, 0, tty->columns);
    }
 }
 
@@ -147,8 +172,7 @@ static void tty_putc(tty_t *tty, char ch) {
       tty_upd_cr(tty);
       tty_upd_lf(tty);
       if (tty->cursor == tty->end) {
-        tty_upd_scrollup(tty);
-        tty_mark_all(tty);
+        tty_upd_scrollup(tty); // marks what changed
       } else {
         tty_mark_line(tty, tty->cursor - tty->columns);
         tty_mark_line(tty, tty->cursor);
@@ -157,8 +181,8 @@ static void tty_putc(tty_t *tty, char ch) {
     default:
       tty_upd_putc(tty, ch);
       if (tty->cursor == tty->end) {
-        tty_upd_scrollup(tty);
-        tty_mark_all(tty);
+        tty_upd_scrollup(tty); // marks what changed
+        tty_mark(tty, tty->cursor);
       } else {
         tty_mark(tty, tty->cursor - 1);
         tty_mark(tty, tty->cursor);
@@ -205,20 +229,28 @@ static int tty_init(device_t *ttydev) {
   tty->lines = fb->info->height / 16;
   tty->columns = fb->info->width / 8;
   tty->size = tty->columns * tty->lines;
+  panic_on((tty->display + 1) * tty->size * 2 > fb->info->num_sprites, "too many sprites for tty");
   tty->buf = pmm->alloc(tty->size * sizeof(tty->buf[0]));
-  tty->dirty = pmm->alloc(tty->size * sizeof(tty->dirty[0]));
+  tty->dirty = pmm->alloc(tty->lines * sizeof(tty->dirty[0]));
+  tty->width = pmm->alloc(tty->lines * sizeof(tty->width[0]));
   tty->end = tty->buf + tty->size;
   tty->sp_buf = pmm->alloc(tty->size * 2 * sizeof(struct sprite));
   for (int i = 0; i < tty->size; i++) {
     tty->buf[i] = tty_defaultch();
   }
-  memset(tty->dirty, 0, tty->size * sizeof(tty->dirty[0]));
+  for (int y = 0; y < tty->lines; y++) {
+    tty->dirty[y] = (struct tty_span) { .lo = tty->columns, .hi = 0 };
+    tty->width[y] = 0;
+  }
+  tty->dirty_lo = tty->lines; tty->dirty_hi = 0;
   tty->cursor = tty->buf;
   struct tty_queue *q = &tty->queue;
   q->front = q->rear = q->buf = pmm->alloc(TTY_COOK_BUF_SZ);
   q->end = q->buf + TTY_COOK_BUF_SZ;
   kmt->sem_init(&tty->lock, "tty lock", 1);
   kmt->sem_init(&tty->cooked, "tty cooked lines", 0);
+  kmt->sem_init(&tty->flush, "tty pending output", 0);
+  tty->pending = 0;
   welcome(ttydev);
   return 0;
 }
@@ -244,14 +276,22 @@ static int tty_read(device_t *dev, int offset, void *buf, int count) {
   return nread;
 }
 
+// Output only updates the character buffer; the flush task renders it at
+// most once per frame. An empty write renders immediately.
 static int tty_write(device_t *dev, int offset, const void *buf, int count) {
   tty_t *tty = dev->ptr;
+  if (count == 0) {
+    tty_render(tty);
+    return 0;
+  }
   kmt->sem_wait(&tty->lock);
   for (int i = 0; i < count; i++) {
     tty_putc(tty, ((const char *)buf)[i]);
   }
   kmt->sem_signal(&tty->lock);
-  tty_render(tty);
+  if (atomic_xchg(&tty->pending, 1) == 0) {
+    kmt->sem_signal(&tty->flush);
+  }
   return count;
 }
 
@@ -265,10 +305,26 @@ devops_t tty_ops = {
 // tty daemon
 // ------------------------------------------------------------------
 
+void dev_tty_flush_task(void *arg) {
+  device_t *ttydev = arg;
+  tty_t *tty = ttydev->ptr;
+  uint64_t last = 0;
+  while (1) {
+    kmt->sem_wait(&tty->flush);
+    sleep_until(last + TTY_FRAME_US); // 距离上一帧不足一帧的时间就睡到下一帧
+    atomic_xchg(&tty->pending, 0); // output from now on needs another frame
+    tty_render(tty);
+    last = io_read(AM_TIMER_UPTIME).us;
+  }
+}
+
 void dev_tty_task(void *arg) {
-  device_t *in =     dev->lookup("input");
-  device_t *ttydev = dev->lookup("tty1");
-  device_t *fb =     dev->lookup("fb");
+  // 设备在启动时解析一次，之后按键切换不再按名字查找
+  device_t *in =     dev->get(dev->handle("input"));
+  device_t *fb =     dev->get(dev->handle("fb"));
+  device_t *ttys[] = { dev->get(dev->handle("tty1")), dev->get(dev->handle("tty2")) };
+  panic_on(!in || !fb || !ttys[0] || !ttys[1], "lookup device failed.");
+  device_t *ttydev = ttys[0];
 
   tty_mark_all(ttydev->ptr);
   tty_render(ttydev->ptr);
@@ -284,8 +340,7 @@ void dev_tty_task(void *arg) {
 
     if (ev.alt) {
       device_t *next = ttydev;
-      if (ev.data == '1') next = dev->lookup("tty1");
-      if (ev.data == '2') next = dev->lookup("tty2");
+      if (ev.data >= '1' && ev.data < '1' + (int)(sizeof(ttys) / sizeof(ttys[0]))) next = ttys[ev.data - '1'];
       if (next != ttydev) {
         printf("(tty) Switch to %s.\n", next->name);
         ttydev = next;
@@ -6,6 +6,7 @@
 
 static sem_t fb_sem;
 static uint8_t term_font[];
+static uint32_t zorder[NSPRITE], ztmp[NSPRITE]; // scratch of fb_compose(), under fb_sem
 
 static void texture_fill(struct texture *tx, int top, uint8_t *bits, uint32_t fg, uint32_t bg) {
   uint32_t *px = tx->pixels;
@@ -36,6 +37,14 @@ int fb_init(device_t *dev) {
     .num_sprites  = NSPRITE,
     .current = 0,
   };
+  fb->nsprite = 0;
+  fb->back = pmm->alloc(fb->info->width * fb->info->height * sizeof(uint32_t));
+  fb->nrow = fb->info->height / TEXTURE_H + 1;
+  fb->row_head = pmm->alloc(fb->nrow * sizeof(int16_t));
+  fb->row_next = pmm->alloc(NSPRITE * sizeof(int16_t));
+  fb->row_prev = pmm->alloc(NSPRITE * sizeof(int16_t));
+  memset(fb->row_head, -1, fb->nrow * sizeof(int16_t));
+  fb->damage.x0 = fb->damage.y0 = fb->damage.x1 = fb->damage.y1 = 0;
   kmt->sem_init(&fb_sem, dev->name, 1);
   font_load(fb, term_font);
   return 0;
@@ -49,6 +58,111 @@ static int fb_read(device_t *dev, int offset, void *buf, int count) {
   return 0;
 }
 
+// compositor
+// ------------------------------------------------------------------
+
+static inline int sp_visible(fb_t *fb, const struct sprite *sp) {
+  return sp->texture > 0 && sp->display == fb->info->current;
+}
+
+static void fb_damage(fb_t *fb, int x0, int y0, int x1, int y1) {
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > fb->info->width)  x1 = fb->info->width;
+  if (y1 > fb->info->height) y1 = fb->info->height;
+  if (x0 >= x1 || y0 >= y1) return;
+  if (fb->damage.x0 >= fb->damage.x1) { // empty
+    fb->damage.x0 = x0; fb->damage.y0 = y0;
+    fb->damage.x1 = x1; fb->damage.y1 = y1;
+    return;
+  }
+  if (x0 < fb->damage.x0) fb->damage.x0 = x0;
+  if (y0 < fb->damage.y0) fb->damage.y0 = y0;
+  if (x1 > fb->damage.x1) fb->damage.x1 = x1;
+  if (y1 > fb->damage.y1) fb->damage.y1 = y1;
+}
+
+static void fb_damage_sprite(fb_t *fb, const struct sprite *sp) {
+  if (sp_visible(fb, sp)) {
+    fb_damage(fb, sp->x, sp->y, sp->x + TEXTURE_W, sp->y + TEXTURE_H);
+  }
+}
+
+// sprites off the bottom of the screen all go to the last row
+static inline int sp_row(fb_t *fb, const struct sprite *sp) {
+  int r = sp->y / TEXTURE_H;
+  return r < fb->nrow ? r : fb->nrow - 1;
+}
+
+static void row_link(fb_t *fb, int i) {
+  int r = sp_row(fb, &fb->sprites[i]);
+  fb->row_prev[i] = -1;
+  fb->row_next[i] = fb->row_head[r];
+  if (fb->row_head[r] >= 0) fb->row_prev[fb->row_head[r]] = i;
+  fb->row_head[r] = i;
+}
+
+static void row_unlink(fb_t *fb, int i) {
+  int prev = fb->row_prev[i], next = fb->row_next[i];
+  if (prev >= 0) fb->row_next[prev] = next;
+  else fb->row_head[sp_row(fb, &fb->sprites[i])] = next;
+  if (next >= 0) fb->row_prev[next] = prev;
+}
+
+// bottom-up merge sort of the (z, index) keys; returns a or tmp, whichever
+// holds the result
+static uint32_t *zsort(uint32_t *a, uint32_t *tmp, int n) {
+  for (int w = 1; w < n; w *= 2) {
+    for (int lo = 0; lo < n; lo += 2 * w) {
+      int mid = lo + w < n ? lo + w : n, hi = lo + 2 * w < n ? lo + 2 * w : n;
+      int i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) tmp[k++] = a[i] <= a[j] ? a[i++] : a[j++];
+      while (i < mid) tmp[k++] = a[i++];
+      while (j < hi)  tmp[k++] = a[j++];
+    }
+    uint32_t *t = a; a = tmp; tmp = t;
+  }
+  return a;
+}
+
+// Redraw the damaged rectangle from the sprites that overlap it, lowest z
+// first (sprite order within a z), and push it with a single FBDRAW.
+static void fb_compose(fb_t *fb) {
+  int x0 = fb->damage.x0, y0 = fb->damage.y0, x1 = fb->damage.x1, y1 = fb->damage.y1;
+  if (x0 >= x1 || y0 >= y1) return;
+  int w = x1 - x0;
+
+  // only the rows whose sprites can reach into [y0, y1)
+  int r0 = y0 - TEXTURE_H + 1 > 0 ? (y0 - TEXTURE_H + 1) / TEXTURE_H : 0;
+  int r1 = (y1 - 1) / TEXTURE_H;
+  if (r1 >= fb->nrow) r1 = fb->nrow - 1;
+  int n = 0;
+  for (int r = r0; r <= r1; r++) {
+    for (int i = fb->row_head[r]; i >= 0; i = fb->row_next[i]) {
+      struct sprite *sp = &fb->sprites[i];
+      if (sp_visible(fb, sp) && sp->x < x1 && sp->x + TEXTURE_W > x0 &&
+          sp->y < y1 && sp->y + TEXTURE_H > y0) {
+        zorder[n++] = (uint32_t)sp->z << 14 | i; // NSPRITE == 1 << 14
+      }
+    }
+  }
+  uint32_t *order = zsort(zorder, ztmp, n);
+
+  memset(fb->back, 0, w * (y1 - y0) * sizeof(uint32_t));
+  for (int k = 0; k < n; k++) {
+    struct sprite *sp = &fb->sprites[order[k] & (NSPRITE - 1)];
+    uint32_t *px = fb->textures[sp->texture].pixels;
+    int sx0 = sp->x < x0 ? x0 : sp->x, sx1 = sp->x + TEXTURE_W > x1 ? x1 : sp->x + TEXTURE_W;
+    int sy0 = sp->y < y0 ? y0 : sp->y, sy1 = sp->y + TEXTURE_H > y1 ? y1 : sp->y + TEXTURE_H;
+    for (int y = sy0; y < sy1; y++) {
+      memcpy(&fb->back[(y - y0) * w + sx0 - x0], &px[(y - sp->y) * TEXTURE_W + sx0 - sp->x],
+             (sx1 - sx0) * sizeof(uint32_t));
+    }
+  }
+  io_write(AM_GPU_FBDRAW, x0, y0, fb->back, w, y1 - y0, true);
+  fb->damage.x0 = fb->damage.x1 = 0;
+}
+
 static int fb_write(device_t *dev, int offset, const void *buf, int count) {
   fb_t *fb = dev->ptr;
   kmt->sem_wait(&fb_sem);
@@ -56,17 +170,29 @@ static int fb_write(device_t *dev, int offset, const void *buf, int count) {
     const struct display_info *info = buf;
     if (fb->info->current != info->current) {
       fb->info->current = info->current;
+      fb_damage(fb, 0, 0, fb->info->width, fb->info->height);
     }
   } else if (offset < SPRITE_BRK) {
     memcpy(((uint8_t *)fb->textures) + offset, buf, count);
+    fb_damage(fb, 0, 0, fb->info->width, fb->info->height); // rare: redraw everything
   } else {
-    // TODO: not remove stale sprites, and does not consider z-values
-    for (struct sprite *sp = (struct sprite *)buf; sp < (struct sprite *)(buf + count); sp++) {
-      if (sp->texture > 0 && sp->display == fb->info->current) {
-        io_write(AM_GPU_FBDRAW, sp->x, sp->y, fb->textures[sp->texture].pixels, TEXTURE_W, TEXTURE_H, true);
-      }
+    // sprites are kept: a write replaces the sprites at its offset
+    int first = (offset - SPRITE_BRK) / sizeof(struct sprite);
+    int n = count / sizeof(struct sprite);
+    if (first + n > fb->info->num_sprites) n = fb->info->num_sprites - first;
+    const struct sprite *sp = buf;
+    for (int i = 0; i < n; i++) {
+      struct sprite *old = &fb->sprites[first + i];
+      if (memcmp(old, &sp[i], sizeof(*old)) == 0) continue;
+      fb_damage_sprite(fb, old);
+      if (old->texture > 0) row_unlink(fb, first + i);
+      *old = sp[i];
+      if (old->texture > 0) row_link(fb, first + i);
+      fb_damage_sprite(fb, old);
     }
+    if (first + n > fb->nsprite) fb->nsprite = first + n;
   }
+  fb_compose(fb);
   kmt->sem_signal(&fb_sem);
   return count;
 }
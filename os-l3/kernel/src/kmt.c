@@ -12,6 +12,11 @@ static task_t * buffers[MAX_CPU];  // 缓存任务，实际上就是上一个cur
 static int Total_Nr = 0; // 任务总数
 static cpu_t cpus[MAX_CPU]; // 表示CPU的状态，主要用来记录锁的嵌套层数和最外层的锁前中断与否
 static spinlock_t task_lk; // used in addTask and kmt_teardown
+// 时钟中断按需设置成单次 (one-shot) 的截止时间: 运行任务时是一个时间片之后,
+// 空闲时推迟到最早的睡眠任务醒来, 但不超过 IDLE_US (被其他 CPU 唤醒的任务要靠它发现)
+#define SLICE_US (10000)
+#define IDLE_US  (50000)
+static uint64_t deadlines[MAX_CPU]; // 每个 CPU 已经设置的截止时间
 
 static void spin_init (spinlock_t *lk, const char *name) ;
 static void spin_lock (spinlock_t *lk) ;
@@ -55,6 +60,15 @@ void addTask(task_t * new){ // 添加一个新的任务：either kernel or usr t
     spin_unlock(&task_lk);
 }
 
+// 在 uptime 到达 deadline 之前不参与调度, 调度器会把定时器设到这个时刻, 不必忙等
+void sleep_until(uint64_t deadline) {
+    bool i = ienabled();
+    iset(false); // 关中断读 current, 防止中途迁移到别的 CPU
+    current->wakeup = deadline;
+    iset(i);
+    while(io_read(AM_TIMER_UPTIME).us < deadline) yield();
+}
+
 task_t * getTask(int pid) {
     for(int i = 0; i < Total_Nr; i++) {
         if(tasks[i] == NULL)continue;
@@ -81,6 +95,15 @@ static Context* kmt_context_save(Event ev, Context *ctx) {
     return NULL;
 }
 
+// 已经设置的截止时间还没到并且不晚于 wake 时不用重新设置, 每次写定时器的开销都不小;
+// 时钟中断之后定时器已经停了 (可能比截止时间稍早触发), 必须重新设置
+static void timer_arm(Event ev, uint64_t now, uint64_t wake) {
+    uint64_t *dl = &deadlines[cpu_current()];
+    if(ev.event != EVENT_IRQ_TIMER && *dl > now && *dl <= wake) return;
+    *dl = wake;
+    io_write(AM_TIMER_CTRL, 0, wake);
+}
+
 static Context* kmt_schedule(Event ev, Context *ctx) {
 
     // step1: buffer record to avoid stack competition
@@ -92,10 +115,15 @@ static Context* kmt_schedule(Event ev, Context *ctx) {
     }
     buffer = current;
 
+    uint64_t now = io_read(AM_TIMER_UPTIME).us, wake = now + IDLE_US;
     int index = current->id, i = 0;
     for(; i < Total_Nr * 10; i++) {
         index = (index + 1) % Total_Nr;
         if(tasks[index] == NULL) continue; // 已经销毁的进程
+        if(tasks[index]->wakeup > now) { // 还在睡眠
+            if(tasks[index]->wakeup < wake) wake = tasks[index]->wakeup;
+            continue;
+        }
         if(!tasks[index]->block && !tasks[index]->dead && tasks[index]->running == 0 && (tasks[index] == current || !atomic_xchg(&tasks[index]->suspend, 1)))
             // 条件是进程调度的关键：
             // 一个任务可以被调度当且仅当：
@@ -109,7 +137,9 @@ static Context* kmt_schedule(Event ev, Context *ctx) {
         current = &idle[cpu_current()];
     } else {
         current = tasks[index]; // 非平庸任务
+        if(now + SLICE_US < wake) wake = now + SLICE_US;
     }
+    timer_arm(ev, now, wake);
     panic_on((current->fence1 != FENCE || current->fence2 != FENCE),"stack overflow!");
     atomic_xchg(&current->running, 1); // 将选中的任务标记为运行状态
     int ntrap = (current->ntrap == 0) ? 0 : --current->ntrap;
@@ -143,6 +173,7 @@ static void kmt_teardown (task_t *task) { // 简单的回收, 不太确定能否
     tasks[task->id] = NULL;
     spin_unlock(&task_lk);
     unprotect(&task->as);
+    pgdefer_release(task);
 
     for(int i = 0; i < task->adrnr; i++) {
         adrspc_t * space = task->adrlist[i];
@@ -181,7 +212,7 @@ void lockPanic(spinlock_t* lk, const char* fmt, ...) { // simply for debugging
     char out[2048];
     va_list va;
     va_start(va, fmt);
-    vsprintf(out, fmt, va);
+    vsnprintf(out, sizeof(out), fmt, va);
     va_end(va);
     putstr(out);
     panic("lock 的错误：异常退出!");
@@ -77,15 +77,154 @@ static void tty_reader(void *arg) {
     tty->ops->write(tty, 0, ps, strlen(ps));
     int nread = tty->ops->read(tty, 0, cmd, sizeof(cmd) - 1);
     cmd[nread] = '\0';
-    sprintf(resp, "tty reader task: got %d character(s).\n", strlen(cmd));
+    if (strcmp(cmd, "stat\n") == 0) dev->stat(); // 输入 stat 打印各设备的读写统计
+    snprintf(resp, sizeof(resp), "tty reader task: got %d character(s).\n", strlen(cmd));
     tty->ops->write(tty, 0, resp, strlen(resp));
   }
 }
 #endif
 
+// 测试五：全屏 FBDRAW 的吞吐量 (Mpixel/s)
+// #define TEST_5
+#ifdef TEST_5
+#define FB_ROUNDS 64
+static void fb_bench(void *arg) {
+  AM_GPU_CONFIG_T cfg = io_read(AM_GPU_CONFIG);
+  int n = cfg.width * cfg.height;
+  uint32_t *pixels = pmm->alloc(n * sizeof(uint32_t)); // 一直保留: 大于 4 KiB 的内存不能 free
+  for (int i = 0; i < n; i++) pixels[i] = i * 0x010203;
+  uint64_t t0 = io_read(AM_TIMER_UPTIME).us;
+  for (int r = 0; r < FB_ROUNDS; r++) {
+    io_write(AM_GPU_FBDRAW, 0, 0, pixels, cfg.width, cfg.height, true);
+  }
+  uint64_t us = io_read(AM_TIMER_UPTIME).us - t0;
+  if (us == 0) us = 1;
+  printf("fbdraw %dx%d: %d us/frame, %d Mpixel/s\n", cfg.width, cfg.height,
+    (int)(us / FB_ROUNDS), (int)((uint64_t)n * FB_ROUNDS / us));
+  while (1) yield();
+}
+#endif
+
+// 测试六：klib memcpy/memset 在不同大小下的吞吐量 (MB/s)
+// #define TEST_6
+#ifdef TEST_6
+#define MEM_TOTAL (64 << 20) // 每个大小总共处理的字节数
+static void mem_bench(void *arg) {
+  char *src = pmm->alloc(1 << 20), *dst = pmm->alloc(1 << 20);
+  for (int size = 8; size <= (1 << 20); size <<= 1) {
+    int rounds = MEM_TOTAL / size;
+    uint64_t t0 = io_read(AM_TIMER_UPTIME).us;
+    for (int r = 0; r < rounds; r++) memcpy(dst, src, size);
+    uint64_t t1 = io_read(AM_TIMER_UPTIME).us;
+    for (int r = 0; r < rounds; r++) memset(dst, r, size);
+    uint64_t t2 = io_read(AM_TIMER_UPTIME).us;
+    printf("%d B: memcpy %d MB/s, memset %d MB/s\n", size,
+      (int)(MEM_TOTAL / (t1 - t0 + 1)), (int)(MEM_TOTAL / (t2 - t1 + 1)));
+  }
+  while (1) yield();
+}
+#endif
+
+// 测试七：整页拷贝/清零与逐字节循环的对比 (MB/s)
+// #define TEST_7
+#ifdef TEST_7
+#define PAGE_TOTAL (256 << 20)
+static void page_bench(void *arg) {
+  static const int sizes[] = { 4 << 10, 2 << 20 };
+  char *src = pmm->alloc(2 << 20), *dst = pmm->alloc(2 << 20);
+  for (int k = 0; k < LENGTH(sizes); k++) {
+    int size = sizes[k], rounds = PAGE_TOTAL / size;
+    uint64_t t0 = io_read(AM_TIMER_UPTIME).us;
+    for (int r = 0; r < rounds; r++)
+      for (volatile char *d = dst, *s = src; d < dst + size; ) *d++ = *s++;
+    uint64_t t1 = io_read(AM_TIMER_UPTIME).us;
+    for (int r = 0; r < rounds; r++) copy_page(dst, src, size);
+    uint64_t t2 = io_read(AM_TIMER_UPTIME).us;
+    for (int r = 0; r < rounds; r++)
+      for (volatile char *d = dst; d < dst + size; ) *d++ = 0;
+    uint64_t t3 = io_read(AM_TIMER_UPTIME).us;
+    for (int r = 0; r < rounds; r++) zero_page(dst, size);
+    uint64_t t4 = io_read(AM_TIMER_UPTIME).us;
+    printf("%d KiB: copy %d -> %d MB/s, zero %d -> %d MB/s\n", size >> 10,
+      (int)(PAGE_TOTAL / (t1 - t0 + 1)), (int)(PAGE_TOTAL / (t2 - t1 + 1)),
+      (int)(PAGE_TOTAL / (t3 - t2 + 1)), (int)(PAGE_TOTAL / (t4 - t3 + 1)));
+  }
+  while (1) yield();
+}
+#endif
+
+// 测试八：klib malloc/free 与原来的 bump 分配器的对比 (分配次数/ms 与峰值占用)
+// 在 pmm 接管 heap 之前运行, 运行完直接 halt
+// #define TEST_8
+#ifdef TEST_8
+#define ML_SLOTS 1024
+#define ML_OPS   (1 << 20)
+// 原来的 klib malloc/free, 只是在越过 heap 末尾时回到开头 (原来的会直接越界);
+// noipa: 和调用 klib 里的函数一样, 是一次真正的函数调用
+static size_t bump_total;
+__attribute__((noipa)) static void *bump_malloc(size_t size) {
+  static void *addr = NULL;
+  if (addr == NULL || addr + size > heap.end) addr = heap.start;
+  void *ret = addr;
+  addr += size;
+  bump_total += size;
+  return ret;
+}
+__attribute__((noipa)) static void bump_free(void *ptr) {}
+
+static void malloc_bench() {
+  static void *slot[ML_SLOTS];
+  srand(1);
+  uint64_t t0 = io_read(AM_TIMER_UPTIME).us;
+  for (int i = 0; i < ML_OPS; i++) { // 同样的操作序列: 保持 ML_SLOTS 个活跃对象, 随机替换
+    int k = i % ML_SLOTS, sz = 16 + rand() % 1024;
+    bump_free(slot[k]);
+    slot[k] = bump_malloc(sz);
+    ((char *)slot[k])[0] = 1;
+  }
+  uint64_t t1 = io_read(AM_TIMER_UPTIME).us;
+  memset(slot, 0, sizeof(slot));
+  srand(1);
+  for (int i = 0; i < ML_OPS; i++) {
+    int k = i % ML_SLOTS, sz = 16 + rand() % 1024;
+    free(slot[k]);
+    slot[k] = malloc(sz);
+    ((char *)slot[k])[0] = 1;
+  }
+  uint64_t t2 = io_read(AM_TIMER_UPTIME).us;
+  printf("bump:   %d allocs/ms, peak %d KiB\n", (int)(ML_OPS * 1000ULL / (t1 - t0 + 1)), (int)(bump_total >> 10));
+  printf("malloc: %d allocs/ms, peak %d KiB\n", (int)(ML_OPS * 1000ULL / (t2 - t1 + 1)), (int)(malloc_footprint() >> 10));
+  halt(0);
+}
+#endif
+
+// 测试九：计时寄存器每次读的开销 (cycles/call)
+// "div" 是改成乘法之前的算法: 读 TSC 再做一次 64 位除法
+// #define TEST_9
+#ifdef TEST_9
+#define TM_CALLS 100000
+static void timer_bench(void *arg) {
+  volatile uint64_t sink = 0;
+  AM_TIMER_CYCLES_T c = io_read(AM_TIMER_CYCLES);
+  uint64_t c0 = c.cycles, mhz = c.hz / 1000000;
+  for (int i = 0; i < TM_CALLS; i++) sink += io_read(AM_TIMER_UPTIME).us;
+  uint64_t c1 = io_read(AM_TIMER_CYCLES).cycles;
+  for (int i = 0; i < TM_CALLS; i++) sink += io_read(AM_TIMER_CYCLES).cycles;
+  uint64_t c2 = io_read(AM_TIMER_CYCLES).cycles;
+  for (int i = 0; i < TM_CALLS; i++) sink += (io_read(AM_TIMER_CYCLES).cycles - c0) / mhz;
+  uint64_t c3 = io_read(AM_TIMER_CYCLES).cycles;
+  printf("uptime %d, cycles %d, div %d cycles/call (%d MHz)\n", (int)((c1 - c0) / TM_CALLS),
+    (int)((c2 - c1) / TM_CALLS), (int)((c3 - c2) / TM_CALLS), (int)mhz);
+  while (1) yield();
+}
+#endif
+
 // 用户程序测试
 
 static void os_init() {
+#ifdef TEST_8
+  malloc_bench();
+#endif
   pmm->init();
   kmt->init();
   uproc->init(); 
@@ -121,13 +260,29 @@ static void os_init() {
   kmt->create(task_alloc(), "tty_reader", tty_reader, "tty2");
 #endif
 
+#ifdef TEST_5
+  kmt->create(task_alloc(), "fb_bench", fb_bench, NULL);
+#endif
+
+#ifdef TEST_6
+  kmt->create(task_alloc(), "mem_bench", mem_bench, NULL);
+#endif
+
+#ifdef TEST_7
+  kmt->create(task_alloc(), "page_bench", page_bench, NULL);
+#endif
+
+#ifdef TEST_9
+  kmt->create(task_alloc(), "timer_bench", timer_bench, NULL);
+#endif
+
 }
 
 #ifndef TEST
 static void os_run() {
   iset(true);
   yield();
-  while(1);
+  while(1) pgzero_work(); // idle: 只有在没有其他可运行的任务时才会执行到这里
 }
 
 #else
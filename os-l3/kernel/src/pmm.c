@@ -12,6 +12,21 @@ lock_t global_lk[SLAB_TYPE_NR]; // 每一种类型的页面对应的锁，用于
 void * pmm_end;
 void * pmm_start;
 
+/* 预清零页面池：kfree 不在临界路径上清零整页，而是把页面挂到 dirty_pg 上，
+   由空闲的 CPU 调用 pgzero_work() 清零之后挂到 zero_pg 上，kalloc 优先从 zero_pg 取 */
+static list * dirty_pg = NULL; // 已释放、尚未清零的 4 KiB 页面
+static list * zero_pg  = NULL; // 已清零、可以直接分配的 4 KiB 页面
+static int dirty_nr = 0, zero_nr = 0;
+static list * dirty_huge = NULL; // 同上，2 MiB 的大页面
+static list * zero_huge  = NULL;
+static int dirty_huge_nr = 0, zero_huge_nr = 0;
+static lock_t zpool_lk = LOCK_INIT(); // 维护以上的链表
+
+/* huge_map 的第 i 位表示 [pmm_start + i * HUGE_PGSZ, + HUGE_PGSZ) 是否为一个已分配的大页面，
+   kfree 依据它区分大页面与 slab 对象（slab 对象不可能与 2 MiB 对齐） */
+#define HUGE_NR (4096)
+static uint8_t huge_map[HUGE_NR / 8];
+
 // 返回 2^i, 满足 2^i >= size
 static size_t align_size(size_t size) {
   size_t ret = 1;
@@ -62,14 +77,75 @@ static void * Big_Mem(size_t size) {
   pmm_current = pmm_current + size;
   assert(pmm_current <= pmm_end);
   unlock(&pmm_lk);
-  memset(ret, 0, size);
+  // 不需要 memset: pmm_current 之后的内存从未被分配过，总是全零的（new_page 同样依赖这一点）
   panic_on(ret == NULL, "kalloc NULL");
   return ret;
 }
 
+// 从预清零页面池中取出一个页面，池为空时返回 NULL
+static void * zpool_get(list ** head, int * nr) {
+  lock(&zpool_lk);
+  list * item = *head;
+  if(item) {
+    *head = item->next;
+    (*nr)--;
+  }
+  unlock(&zpool_lk);
+  if(item) item->next = item->addr = NULL; // 链表节点本身占用的部分也需要清零
+  return item;
+}
+
+static void zpool_put(list ** head, int * nr, void * ptr) {
+  list * item = (list *)ptr;
+  lock(&zpool_lk);
+  item->addr = ptr;
+  item->next = *head;
+  *head = item;
+  (*nr)++;
+  unlock(&zpool_lk);
+}
+
+static int huge_index(void * ptr) {
+  return (int)(((uintptr_t)ptr - (uintptr_t)pmm_start) / HUGE_PGSZ);
+}
+
+static int is_huge(void * ptr) {
+  if((uintptr_t)ptr % HUGE_PGSZ != 0 || ptr < pmm_start) return 0;
+  int idx = huge_index(ptr);
+  return idx < HUGE_NR && (huge_map[idx / 8] >> (idx % 8) & 1);
+}
+
+// 分配一个 2 MiB 对齐的大页面：预清零的大页面 -> 已释放的大页面（就地清零）-> 新的内存
+static void * huge_alloc() {
+  void * ret = zpool_get(&zero_huge, &zero_huge_nr);
+  if(ret) return ret;
+  if((ret = zpool_get(&dirty_huge, &dirty_huge_nr)) != NULL) {
+    zero_page(ret, HUGE_PGSZ);
+    return ret;
+  }
+  ret = Big_Mem(HUGE_PGSZ); // Big_Mem 按照 size 对齐
+  int idx = huge_index(ret);
+  panic_on(idx >= HUGE_NR, "too many huge pages");
+  lock(&pmm_lk);
+  huge_map[idx / 8] |= 1 << (idx % 8);
+  unlock(&pmm_lk);
+  return ret;
+}
+
 static void *kalloc(size_t size) {
   size = align_size(size); // 对齐
   void * ret = NULL;
+  // 4 KiB: 预清零的页面 -> 已释放的页面（就地清零，所有 CPU 都忙时 pgzero_work 不会运行）-> 新的内存
+  if(size == ZPGSZ && (ret = zpool_get(&zero_pg, &zero_nr)) != NULL) {
+    return ret;
+  }
+  if(size == ZPGSZ && (ret = zpool_get(&dirty_pg, &dirty_nr)) != NULL) {
+    zero_page(ret, ZPGSZ);
+    return ret;
+  }
+  if(size == HUGE_PGSZ) {
+    return huge_alloc();
+  }
   int type; // 得到当前的对齐类型
   for(type = 0; type < SLAB_TYPE_NR; type++) {
     if(size == types[type]) break;
@@ -115,6 +191,7 @@ static void *kalloc(size_t size) {
   }
   assert((uintptr_t)ret % size == 0);
   panic_on(ret == NULL, "alloc NULL!");
+  ((list *)ret)->next = ((list *)ret)->addr = NULL; // 清掉 slab 链表节点，和 zpool_get 一样
   // memset(ret, 0, size); // for debugging
   return ret;
 }
@@ -122,9 +199,17 @@ static void *kalloc(size_t size) {
 static void kfree(void *ptr) {
   // 大内存会出现回收出现问题的情况，尚未处理
   assert(ptr);
+  if(is_huge(ptr)) {
+    zpool_put(&dirty_huge, &dirty_huge_nr, ptr);
+    return;
+  }
   // 需要知道属于哪一种页面
   page_t * pg = (page_t *)((uintptr_t)ptr & ~(PGSZ - 1));
   int sz = pg->size;
+  if(sz == ZPGSZ) { // 整页的清零推迟到空闲的 CPU 上完成
+    zpool_put(&dirty_pg, &dirty_nr, ptr);
+    return;
+  }
   lock(&(pg->lk));
   list * item = (list *)ptr;
   memset(ptr, 0, sz);
@@ -176,6 +261,28 @@ static void pmm_init() {
 #endif
 
 
+// 在空闲的 CPU 上调用：清零一个已经释放的页面并放入预清零页面池
+// 返回 1 表示本次完成了清零工作，0 表示没有需要清零的页面
+int pgzero_work() {
+  bool enable = ienabled();
+  iset(false);
+  int huge = 0;
+  void * item = zpool_get(&dirty_pg, &dirty_nr);
+  if(item == NULL) {
+    item = zpool_get(&dirty_huge, &dirty_huge_nr);
+    huge = 1;
+  }
+  if (enable) iset(true);
+  if(item == NULL) return 0;
+
+  zero_page(item, huge ? HUGE_PGSZ : ZPGSZ); // 页面已经从链表上摘下，可以在开中断的情况下清零
+  iset(false);
+  if(huge) zpool_put(&zero_huge, &zero_huge_nr, item);
+  else     zpool_put(&zero_pg, &zero_nr, item);
+  if (enable) iset(true);
+  return 1;
+}
+
 static void *kalloc_safe(int size) {
   bool enable = ienabled();
   iset(false);
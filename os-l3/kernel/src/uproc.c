@@ -2,6 +2,7 @@
 #include <syscall.h>
 #include <user.h>
 #include <common.h>
+#include <elf.h>
 #include "initcode.inc"
 
 static spinlock_t wait_lk; // used for exit and wait
@@ -18,26 +19,52 @@ static int sleep(task_t *task, int seconds);
 static int64_t uptime(task_t *task);
 static Context* syscall(Event ev, Context* ctx) ; // 系统调用
 static Context* pagefault(Event ev, Context* ctx) ; // 缺页异常处理函数
-static task_t * uproc_create(char * name, int runnable); // 创建用户进程
+static task_t * uproc_create(char * name, int runnable, image_t * img); // 创建用户进程
+static void img_load(image_t * img, const char * name, const uint8_t * elf, int len); // 解析 ELF 映像
 static adrspc_t * addralloc(void * start, void * end, int prot, int share);// 申请并初始化地址段元素
+static int huge_pg(adrspc_t * space, void * va); // va 所在的页面是否为大页面
 
 cpy_wrt_t refcnt; 
 static spinlock_t pg_lk; // to manage the refcnt  
+static void * zeropg; // 全局共享的零页面：读未写过的匿名页面时映射它，写时再copy-on-write
+static image_t init_img; // init 程序的映像
 void inc_pgcnt(void* pa) { // increment page count
+    if(pa == zeropg) return; // 零页面永远不会被回收，不需要引用计数
     int index = (uintptr_t)(pa - heap.start) / (4096); // the index of pa in refcnt
     panic_on(index >= TOTPGNR || index < 0, "invalid physical addr");
     kmt->spin_lock(&pg_lk);
     refcnt.pgcnt[index] += 1;
     kmt->spin_unlock(&pg_lk);
 }
-void dec_pgcnt(void* pa) { // decrease page cnt
+static int pgcnt_put(void* pa) { // 引用计数减 1，返回页面是否已经没有引用
+    if(pa == zeropg) return 0;
     int index = (uintptr_t)(pa - heap.start) / (4096);
     panic_on(index >= TOTPGNR || index < 0, "invalid physical addr");
     panic_on(refcnt.pgcnt[index] < 1, "decrease cnt fail");
     kmt->spin_lock(&pg_lk);
-    refcnt.pgcnt[index] -= 1;
-    if(refcnt.pgcnt[index] == 0) pmm->free(pa); // free the page iff. page cnt is zero
+    int last = (--refcnt.pgcnt[index] == 0);
     kmt->spin_unlock(&pg_lk);
+    return last;
+}
+void dec_pgcnt(void* pa) { // decrease page cnt
+    if(pgcnt_put(pa)) pmm->free(pa); // free the page iff. page cnt is zero
+}
+// 刚取消映射的页面，别的 CPU 的 TLB 里可能还有它：shootdown 在本 CPU 从这次 trap 返回时
+// 才发出并等待完成，在此之前不能交还给 pmm。先挂在任务上，任务下一次进入 trap 时
+// (此前的 shootdown 一定已经完成) 或者被回收时再释放
+static void dec_pgcnt_defer(task_t *task, void* pa) {
+    if(!pgcnt_put(pa)) return;
+    *(void **)pa = task->pgdefer; // 页面已经没有引用，直接用它存放链表指针
+    task->pgdefer = pa;
+}
+void pgdefer_release(task_t *task) {
+    void * pa = task->pgdefer;
+    task->pgdefer = NULL;
+    while(pa) {
+        void * nxt = *(void **)pa;
+        pmm->free(pa);
+        pa = nxt;
+    }
 }
 
 MODULE_DEF(uproc) = {
@@ -59,8 +86,11 @@ static void init() {
     os->on_irq(0, EVENT_PAGEFAULT,  pagefault); // 不太确定
     kmt->spin_init(&wait_lk, "wait lock");
     kmt->spin_init(&pg_lk, "page lock");
-    Log("[code length]:%d Bytes", _init_len);
-	uproc_create("init", 1);  // 创建初始化用户进程
+    zeropg = pmm->alloc(4096);
+    zero_page(zeropg, 4096); // 零页面会被映射给用户，不能残留任何内核数据
+    Log("[image length]:%d Bytes", _init_len);
+    img_load(&init_img, "init", _init, _init_len);
+	uproc_create("init", 1, &init_img);  // 创建初始化用户进程
 }
 
 static int kputc(task_t *task, char ch) {
@@ -71,7 +101,7 @@ static int kputc(task_t *task, char ch) {
 static int fork(task_t *task) {
     /* 实现了copy-on-write */
     task_t * parent = task; // 父进程
-    task_t * child = uproc_create(NULL, 0); // 创建子进程，尚且不允许调度
+    task_t * child = uproc_create(NULL, 0, NULL); // 创建子进程（地址空间为空），尚且不允许调度
     child->parent = parent;
 
     // 将新建的任务添加到parent的子进程的链表中
@@ -96,18 +126,21 @@ static int fork(task_t *task) {
         space = adrlist[i];
         kmt->spin_lock(&space->adrlk);
         if(space->share == 1) space->refcnt++; // 共享地址段引用计数加一
-        adrspc_t * newspc = (space->share == 1 || child->adrlist[i] == NULL) ? space : pmm->alloc(sizeof(adrspc_t)); // 如果共享，那么使用同一个指针，否则申请之后memcpy
         kmt->spin_unlock(&space->adrlk);
+        // 如果共享，那么使用同一个指针，否则申请新的地址段之后复制
+        adrspc_t * newspc = (space->share == 1) ? space : addralloc(space->area.start, space->area.end, space->prot, 0);
         if(!space->share) { // 将非共享映射页面添加到子进程的地址空间
-            newspc->pgnr = space->pgnr; newspc->share = space->share; newspc->prot = space->prot;
-            newspc->area = (Area){space->area.start, space->area.end};
+            newspc->pgnr = space->pgnr;
+            newspc->huge = space->huge;
+            newspc->file = space->file; newspc->filesz = space->filesz;
             for(int j = 0; j < space->pgnr; j++) {
                 void * va = space->va[j];
                 void * pa = space->pa[j];
+                int hflag = huge_pg(space, va) ? MMAP_HUGE : 0;
                 newspc->va[j] = va;
                 newspc->pa[j] = pa;
-                if(space->prot & PROT_WRITE) { map(&parent->as, va, pa, PROT_NONE); map(&parent->as, va, pa, PROT_READ); } // 将父进程中写权限页面转化为只读页面
-                map(&child->as, va, pa, PROT_READ);
+                if(space->prot & PROT_WRITE) { map(&parent->as, va, pa, PROT_NONE | hflag); map(&parent->as, va, pa, PROT_READ | hflag); } // 将父进程中写权限页面转化为只读页面
+                map(&child->as, va, pa, PROT_READ | hflag);
                 inc_pgcnt(pa); // 将该页面的引用计数加一
             }
         }
@@ -225,9 +258,12 @@ static void* _mmap(task_t *task, void *addr, int length, int prot, int flags) {
     length = (int)UPROUND(length, pgsize); // 上对齐到页面大小
     addr = (void*)UPROUND((uintptr_t)addr, pgsize); // 上对齐到页面大小
     void * ret = ((uintptr_t)fraddr >= (uintptr_t)addr) ? fraddr : addr; 
+    int huge = HAS_HUGEPG && !share && length >= HUGE_PGSZ; // 足够大的私有映射使用大页面
+    if(huge) ret = (void*)UPROUND((uintptr_t)ret, HUGE_PGSZ);
     task->fraddr = ret + length; // 仔细思考
     panic_on((uintptr_t)task->fraddr > (uintptr_t)task->as.area.end, "mmap");
     adrspc_t * space = addralloc(ret, ret + length, prot, share); 
+    space->huge = huge;
     task->adrlist[task->adrnr] = space;
     task->adrnr++;
     // Log("[%p,%p)  #%d", ret, ret + length, task->id);
@@ -243,7 +279,11 @@ static void* _unmap(task_t *task, void *addr, int length, int flags) {
         if(addr == space->area.start && length == size) { // [addr, addr + len):检查是否是之前map出去的空间
             // Log("[%p, %p) #%d", space->area.start, space->area.end, task->id);
             if(space->share == 1) space->refcnt--; // 对于共享页面的unmap，只需将该地址段的引用计数减去 1 就可以了
-            else for(int j = 0; j < space->pgnr; j++) dec_pgcnt(space->pa[j]); // 对于非共享页面的unmap，需要将该地址段的全部的页面的引用计数减少 1
+            else for(int j = 0; j < space->pgnr; j++) { // 对于非共享页面的unmap，先取消映射（其他 CPU 的 TLB 随之失效），再将页面的引用计数减少 1
+                int hflag = huge_pg(space, space->va[j]) ? MMAP_HUGE : 0;
+                map(&task->as, space->va[j], space->pa[j], MMAP_NONE | hflag);
+                dec_pgcnt_defer(task, space->pa[j]);
+            }
             kmt->spin_unlock(&space->adrlk); 
             for(int j = i; j + 1 < task->adrnr; j++) task->adrlist[j] = task->adrlist[j + 1]; // 移除当前的地址段
             task->adrnr--;   
@@ -272,8 +312,7 @@ static int getpid(task_t *task) {
 }
 
 static int sleep(task_t *task, int seconds) {
-	uint64_t wakeup_time = io_read(AM_TIMER_UPTIME).us + 1000000L * seconds;
-	while(io_read(AM_TIMER_UPTIME).us < wakeup_time) yield(); // 这里的上下文会被保存下来，当sleep的时间达到要求值时，将会返回到syscall函数
+	sleep_until(io_read(AM_TIMER_UPTIME).us + 1000000L * seconds); // 这里的上下文会被保存下来，当sleep的时间达到要求值时，将会返回到syscall函数
 	return 0;
 }
 
@@ -285,6 +324,7 @@ static int64_t uptime(task_t *task) {
 static Context* syscall(Event ev, Context* ctx) {
 	task_t * proc = current_proc();
     assert(proc->ntrap == 1); // 嵌套必须是 1，系统调用前的上下文存在context[0]
+    pgdefer_release(proc); // 上一次 trap 返回时 shootdown 已经完成
 	uintptr_t ret = 0;
 	iset(true); // 进行系统调用前打开中断
     switch(ctx->GPRx) {
@@ -306,6 +346,13 @@ static Context* syscall(Event ev, Context* ctx) {
     return NULL;
 }
 
+// 文件映射的地址段：将 va 所在页面对应的文件内容拷贝到 pa（pa 是预清零的页面）
+static void fill_page(adrspc_t * space, void * va, void * pa, int pgsize) {
+    uintptr_t off = (uintptr_t)va - (uintptr_t)space->area.start;
+    if(space->file == NULL || off >= space->filesz) return;
+    memcpy(pa, space->file + off, (space->filesz - off > pgsize) ? pgsize : space->filesz - off);
+}
+
 static void shr_pgmap(task_t * task, void * va, adrspc_t * space) {
     kmt->spin_lock(&space->adrlk); // 需要上锁
     void * pa = NULL;
@@ -318,6 +365,7 @@ static void shr_pgmap(task_t * task, void * va, adrspc_t * space) {
     }
     if(i == space->pgnr) { // 说明没有任何一个进程对该共享虚拟地址申请物理页面，那么我们需要申请新的物理页面
         pa = pmm->alloc(task->as.pgsize);
+        fill_page(space, va, pa, task->as.pgsize); // 共享的只读代码段：只在第一次缺页时拷贝一次
         space->va[space->pgnr] = va;
         space->pa[space->pgnr] = pa;
         space->pgnr++;
@@ -330,7 +378,6 @@ static void shr_pgmap(task_t * task, void * va, adrspc_t * space) {
 // 非共享页面的page map
 static void unshr_pgmap(task_t* task, adrspc_t * space, void * va, void * pa, int prot) {
     int i = 0, pgnr = space->pgnr;
-    AddrSpace * as = &task->as;
     for(; i < pgnr; i++) if(va == space->va[i]) break;
     space->va[i] = va;
     space->pa[i] = pa;
@@ -339,16 +386,12 @@ static void unshr_pgmap(task_t* task, adrspc_t * space, void * va, void * pa, in
     map(&task->as, va, pa, prot);
     Log("va = %p  pa = %p", va, pa);
     inc_pgcnt(pa); // to incre page cnt
-    if((uintptr_t)va <= (uintptr_t)as->area.start + _init_len) { // code area 缺页时需要特殊处理
-        int code_posi = (int)((uintptr_t)va - (uintptr_t)as->area.start); // 本次代码拷贝开始位置
-        int copy_len = ((_init_len - code_posi) > as->pgsize) ? as->pgsize : (_init_len - code_posi); // 本次复制的长度
-        memcpy(pa, _init + code_posi, copy_len);
-    }
 }
 
 // 缺页处理函数：共享和非共享分开
 static Context* pagefault(Event ev, Context* ctx) {
 	task_t * proc = current_proc();
+    pgdefer_release(proc);
     AddrSpace* as = &proc->as;
     void * va = (void *)(ev.ref & ~(as->pgsize - 1L));
     int pgsize = as->pgsize;
@@ -371,6 +414,12 @@ static Context* pagefault(Event ev, Context* ctx) {
         shr_pgmap(proc, va, space);
         return NULL;
     }
+    int hflag = 0; // 大页面：va 对齐到 2 MiB，之后的分配、拷贝都以 2 MiB 为单位
+    if(huge_pg(space, va)) {
+        va = (void *)ROUNDDOWN(va, HUGE_PGSZ);
+        pgsize = HUGE_PGSZ;
+        hflag = MMAP_HUGE;
+    }
     // 非共享页面的处理, 不需要上锁
     int maped = 0; // 地址段内是否已经有该虚拟地址的映射：yes, prot trans; no, pure page fault
     void * pa = NULL;
@@ -381,49 +430,121 @@ static Context* pagefault(Event ev, Context* ctx) {
     }
     if(maped == 0) {
         Log("pure page absence(unshared pages)"); 
-        pa = pmm->alloc(pgsize);
-        unshr_pgmap(proc, space, va, pa, PROT_READ); // 仅仅以只读的形式映射
+        if(hflag) { // 大页面不使用零页面，直接分配
+            panic_on(!(tprot & PROT_WRITE) && (ev.cause & PROT_WRITE), "invalid prot");
+            pa = pmm->alloc(pgsize);
+            unshr_pgmap(proc, space, va, pa, tprot | hflag);
+        } else if(space->file && (uintptr_t)va - (uintptr_t)space->area.start < space->filesz) { // 可写的数据段：拷贝文件内容
+            panic_on(!(tprot & PROT_WRITE) && (ev.cause & PROT_WRITE), "invalid prot");
+            pa = pmm->alloc(pgsize);
+            fill_page(space, va, pa, pgsize);
+            unshr_pgmap(proc, space, va, pa, tprot);
+        } else if(ev.cause & PROT_WRITE) { // 第一次访问就是写：直接分配预清零的页面
+            panic_on(!(tprot & PROT_WRITE), "invalid prot");
+            pa = pmm->alloc(pgsize);
+            unshr_pgmap(proc, space, va, pa, tprot);
+        } else { // 读未写过的匿名页面：映射共享的零页面，写的时候再分配
+            unshr_pgmap(proc, space, va, zeropg, PROT_READ);
+        }
+    } else if(pa == zeropg) {
+        Log("zero page prot trans");
+        panic_on(!(tprot & PROT_WRITE) && (ev.cause & PROT_WRITE), "invalid prot");
+        map(as, va, pa, MMAP_NONE);
+        unshr_pgmap(proc, space, va, pmm->alloc(as->pgsize), tprot); // 预清零的页面，不需要拷贝
     } else {
         Log("old page prot trans"); // 权限不足，此时需要将原有的页面引用计数改变
         panic_on(share == 1, "the prot of share page should not change"); 
         panic_on(!(tprot & PROT_WRITE) && (ev.cause & PROT_WRITE), "invalid prot"); // 检查真正的权限，如果原先不具备写权限但是现在要求写，那么出错
-        map(as, va, pa, MMAP_NONE); // unmap，取消旧的物理页面的映射
-        void * nwpa = pmm->alloc(as->pgsize); // 申请一个新的页面
-        memcpy(nwpa, pa, as->pgsize); // 不要忘了将旧的页面的内容拷贝过来
-        dec_pgcnt(pa); // 将原来的页面引用计数减去 1
-        unshr_pgmap(proc, space, va, nwpa, tprot);
+        map(as, va, pa, MMAP_NONE | hflag); // unmap，取消旧的物理页面的映射
+        void * nwpa = pmm->alloc(pgsize); // 申请一个新的页面
+        copy_page(nwpa, pa, pgsize); // 不要忘了将旧的页面的内容拷贝过来
+        dec_pgcnt_defer(proc, pa); // 将原来的页面引用计数减去 1
+        unshr_pgmap(proc, space, va, nwpa, tprot | hflag);
     }
     return NULL;
 }
 
+static int huge_pg(adrspc_t * space, void * va) {
+    uintptr_t hva = ROUNDDOWN(va, HUGE_PGSZ); // 只有完整地落在地址段内的 2 MiB 区域才使用大页面
+    return space->huge && hva >= (uintptr_t)space->area.start && hva + HUGE_PGSZ <= (uintptr_t)space->area.end;
+}
+
 static adrspc_t* addralloc(void * start, void * end, int prot, int share) {
     adrspc_t* space = pmm->alloc(sizeof(adrspc_t));
     space->area.start = start; space->area.end = end;
     space->prot = prot;      space->share = share;
+    space->huge = 0;
+    space->file = NULL;      space->filesz = 0;
     kmt->spin_init(&space->adrlk, NULL);
     space->refcnt = 1;       space->pgnr = 0;
     return space;
 }
 
-static task_t * uproc_create(char * name, int runnable) {
+static void img_load(image_t * img, const char * name, const uint8_t * elf, int len) {
+    const Elf64_Ehdr * eh = (const Elf64_Ehdr *)elf;
+    panic_on(len < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0, "invalid ELF image");
+    panic_on(eh->e_ident[4] != ELFCLASS64 || eh->e_type != ET_EXEC, "unsupported ELF image");
+    img->name = name; img->elf = elf;
+    img->entry = eh->e_entry;
+    img->end = NULL; img->segnr = 0;
+    for(int i = 0; i < eh->e_phnum; i++) {
+        const Elf64_Phdr * ph = (const Elf64_Phdr *)(elf + eh->e_phoff + i * eh->e_phentsize);
+        if(ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+        panic_on(img->segnr >= SEG_NR, "too many segments");
+        panic_on(ph->p_offset + ph->p_filesz > len, "truncated ELF image");
+        void * start = (void *)ROUNDDOWN(ph->p_vaddr, PGSIZE);
+        void * end = (void *)UPROUND(ph->p_vaddr + ph->p_memsz, PGSIZE);
+        panic_on((uintptr_t)start < (uintptr_t)img->end, "overlapping segments"); // 段之间不能共用页面
+        // 页内 p_vaddr 之前的部分同样来自文件，这样文件内容和虚拟地址按页对齐
+        uintptr_t pad = ph->p_vaddr - (uintptr_t)start;
+        typeof(img->seg[0]) * seg = &img->seg[img->segnr++];
+        seg->area = (Area){start, end};
+        seg->prot = PROT_READ | ((ph->p_flags & PF_W) ? PROT_WRITE : 0);
+        seg->file = elf + ph->p_offset - pad;
+        seg->filesz = pad + ph->p_filesz;
+        seg->shared = NULL;
+        if(!(ph->p_flags & PF_W)) { // 只读段：建立一个共享的地址段，所有进程共用同一份物理页面
+            seg->shared = addralloc(start, end, seg->prot, 1);
+            seg->shared->file = seg->file; seg->shared->filesz = seg->filesz;
+        }
+        img->end = end;
+    }
+    panic_on(img->segnr == 0, "no loadable segment");
+}
+
+static task_t * uproc_create(char * name, int runnable, image_t * img) {
     task_t * usr_task = pmm->alloc(sizeof(task_t)); // _init
     TASK_INIT(usr_task); // 初始化
     usr_task->name = name;
     usr_task->running = !(runnable); // 是否立即被调度
     protect(&usr_task->as);
-    usr_task->context[0] = ucontext(&usr_task->as, (Area) {usr_task->stack, usr_task->stack + STACK_SIZE}, usr_task->as.area.start); // 第一个上下文初始化
-    
-    // 地址空间的第一个部分：代码区域
-    usr_task->fraddr = usr_task->as.area.start + UPROUND(_init_len, usr_task->as.pgsize); // 用户mmap空闲空间起始地址:代码区域的终点
-    adrspc_t* code = addralloc(usr_task->as.area.start, usr_task->fraddr,
-                               PROT_READ | PROT_WRITE,  0);
+    void * entry = img ? (void *)img->entry : usr_task->as.area.start;
+    usr_task->context[0] = ucontext(&usr_task->as, (Area) {usr_task->stack, usr_task->stack + STACK_SIZE}, entry); // 第一个上下文初始化
+    usr_task->fraddr = usr_task->as.area.start;
+    usr_task->adrnr = 0;
+    if(img == NULL) { // fork：地址空间由 fork 从父进程复制
+        addTask(usr_task);
+        return usr_task;
+    }
+
+    // 地址空间的第一个部分：程序的各个段，按需从映像中装载
+    for(int i = 0; i < img->segnr; i++) {
+        adrspc_t * space = img->seg[i].shared;
+        if(space) { // 只读段：共享映像中的地址段
+            kmt->spin_lock(&space->adrlk);
+            space->refcnt++;
+            kmt->spin_unlock(&space->adrlk);
+        } else { // 可写段：每个进程私有，缺页时拷贝
+            space = addralloc(img->seg[i].area.start, img->seg[i].area.end, img->seg[i].prot, 0);
+            space->file = img->seg[i].file; space->filesz = img->seg[i].filesz;
+        }
+        usr_task->adrlist[usr_task->adrnr++] = space;
+    }
+    usr_task->fraddr = img->end; // 用户mmap空闲空间起始地址:最后一个段的终点
     // 地址空间的第二个部分：用户栈
     adrspc_t* ustk = addralloc(usr_task->as.area.end - 1 * GB, usr_task->as.area.end,
                                PROT_READ | PROT_WRITE,  0); // 用户栈帧
-    
-    usr_task->adrlist[0] = code;
-    usr_task->adrlist[1] = ustk;
-    usr_task->adrnr = 2;    
+    usr_task->adrlist[usr_task->adrnr++] = ustk;
 
     addTask(usr_task);
     return usr_task;
@@ -373,6 +373,19 @@ void test_19() {
   else
     exit(0);
 }
+void test_20() {  // 未写过的匿名页面读出来必须全零，不能泄露内核数据
+  int npg = 16;
+  void *rladdr = mmap(NULL, npg * PG_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+  panic_on(rladdr == NULL, "mmap fail!");
+  char *p = (char *)rladdr;
+  for (int i = 0; i < npg * PG_SZ; i++)  // 只读：映射的是共享的零页面
+    panic_on(p[i] != 0, "test_20 fail: untouched page is not zero");
+  for (int i = 0; i < npg; i += 2) p[i * PG_SZ] = 1;  // 写：每次分配一个新页面
+  for (int i = 0; i < npg * PG_SZ; i++)
+    panic_on(p[i] != (i % (2 * PG_SZ) == 0), "test_20 fail: fresh page is not zero");
+  mmap(rladdr, npg * PG_SZ, PROT_READ | PROT_WRITE, MAP_UNMAP);
+  PASS("test_20::untouched pages read as zero");
+}
 int main() {
   test_1();
   test_2();
@@ -393,5 +406,6 @@ int main() {
   // test_17();
   // test_18();
   // test_19();
+  // test_20();
   return 0;
 }